@@ -1,11 +1,22 @@
 #include <stdio.h>
+#include <math.h>
+#include <stdlib.h>
+#include <time.h>
 
 #include "image8bit.h"
 #include "instrumentation.h"
 
-int main(int ac, char *av[]) {
-  ImageInit();
+// Wall clock time in seconds
+// (cpu_time adds up the time of all threads, so it is not used to time
+// parallel operations.)
+static double wall_time(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (double)now.tv_sec + 1.0e-9 * (double)now.tv_nsec;
+}
 
+// Blur a blank image and print the instrumentation counters.
+static void benchmarkBlur(void) {
   Image img = ImageCreate(300, 300, 255);
 
   InstrReset();
@@ -15,6 +26,329 @@ int main(int ac, char *av[]) {
   InstrPrint();
 
   ImageDestroy(&img);
+}
+
+// Blur a large image with the given number of threads and print the time it
+// takes.
+static void benchmarkBlurThreads(int threads) {
+  Image img = ImageCreate(4000, 4000, 255);
+  ImageSetThreads(threads);
+
+  double time = wall_time();
+  ImageBlur(img, 7, 7);
+  printf("# ImageBlur 4000x4000 (%d threads): %.6f s\n", threads,
+         wall_time() - time);
+
+  ImageSetThreads(0);
+  ImageDestroy(&img);
+}
+
+// Blur a large image with small radii, where the specialized kernels are used
+// up to 3, and print the time each one takes.
+static void benchmarkBlurRadii(void) {
+  Image img = ImageCreate(4000, 4000, 255);
+
+  for (int radius = 1; radius <= 4; radius++) {
+    double time = wall_time();
+    ImageBlur(img, radius, radius);
+    printf("# ImageBlur %dx%d 4000x4000: %.6f s\n", 2 * radius + 1,
+           2 * radius + 1, wall_time() - time);
+  }
+
+  ImageDestroy(&img);
+}
+
+// Blur a large image in place and print the time it takes.
+static void benchmarkBlurInPlace(void) {
+  Image img = ImageCreate(4000, 4000, 255);
+
+  double time = cpu_time();
+  ImageBlurInPlace(img, 7, 7);
+  printf("# ImageBlurInPlace 4000x4000: %.6f s\n", cpu_time() - time);
+
+  ImageDestroy(&img);
+}
+
+// Blur a large image with a radius map of a single level, through its
+// integral image, and print the time it takes.
+static void benchmarkBlurRadiusMap(void) {
+  Image img = ImageCreate(4000, 4000, 255);
+  // The negative of a black image with maxval 7 has every radius 7
+  Image radius = ImageCreate(4000, 4000, 7);
+  ImageNegative(radius);
+
+  double time = wall_time();
+  ImageBlurRadiusMap(img, radius);
+  printf("# ImageBlurRadiusMap 4000x4000: %.6f s\n", wall_time() - time);
+
+  ImageDestroy(&radius);
+  ImageDestroy(&img);
+}
+
+// Blur a large image with Gaussian filters of increasing sigma, whose cost
+// should not depend on sigma, and print the time each one takes.
+static void benchmarkGaussianBlur(void) {
+  Image img = ImageCreate(4000, 4000, 255);
+
+  for (double sigma = 2.0; sigma <= 200.0; sigma *= 10.0) {
+    double time = cpu_time();
+    ImageGaussianBlur(img, sigma);
+    printf("# ImageGaussianBlur sigma %g 4000x4000: %.6f s\n", sigma,
+           cpu_time() - time);
+  }
+
+  ImageDestroy(&img);
+}
+
+// Convolve a large image with kernels of 3, 5 (which have specialized
+// passes) and 7 taps, and print the time each one takes.
+static void benchmarkConvolve(void) {
+  Image img = ImageCreate(4000, 4000, 255);
+  const int kernel[7] = {1, 2, 3, 4, 3, 2, 1};
+
+  for (int taps = 3; taps <= 7; taps += 2) {
+    const int *k = kernel + (7 - taps) / 2;
+    double time = cpu_time();
+    ImageConvolve(img, k, taps, k, taps, 16, 0);
+    printf("# ImageConvolve %dx%d 4000x4000: %.6f s\n", taps, taps,
+           cpu_time() - time);
+  }
+
+  ImageDestroy(&img);
+}
+
+// Median filter a large random image with increasing radii, whose cost
+// should not depend on the radius, and print the time each one takes.
+static void benchmarkMedian(void) {
+  Image img = ImageCreate(4000, 4000, 255);
+
+  for (int radius = 1; radius <= 100; radius *= 10) {
+    unsigned int seed = 1;
+    for (int y = 0; y < 4000; y++) {
+      for (int x = 0; x < 4000; x++) {
+        seed = seed * 1103515245 + 12345;
+        ImageSetPixel(img, x, y, (seed >> 16) & 255);
+      }
+    }
+    double time = wall_time();
+    ImageMedian(img, radius, radius);
+    printf("# ImageMedian %dx%d 4000x4000: %.6f s\n", 2 * radius + 1,
+           2 * radius + 1, wall_time() - time);
+  }
+
+  ImageDestroy(&img);
+}
+
+// Apply the pixel transformations to a large image and print the time each
+// one takes.
+static void benchmarkPointOps(void) {
+  Image img = ImageCreate(4000, 4000, 255);
+
+  double time = cpu_time();
+  ImageNegative(img);
+  printf("# ImageNegative 4000x4000: %.6f s\n", cpu_time() - time);
+
+  time = cpu_time();
+  ImageThreshold(img, 128);
+  printf("# ImageThreshold 4000x4000: %.6f s\n", cpu_time() - time);
+
+  time = cpu_time();
+  ImageBrighten(img, 1.3);
+  printf("# ImageBrighten 4000x4000: %.6f s\n", cpu_time() - time);
+
+  ImageDestroy(&img);
+}
+
+// Rotate a large image in all the ways and print the time each one takes.
+static void benchmarkRotate(void) {
+  Image img = ImageCreate(4000, 4000, 255);
+
+  double time = cpu_time();
+  Image rotated = ImageRotate(img);
+  printf("# ImageRotate 4000x4000: %.6f s\n", cpu_time() - time);
+  ImageDestroy(&rotated);
+
+  time = cpu_time();
+  rotated = ImageRotate180(img);
+  printf("# ImageRotate180 4000x4000: %.6f s\n", cpu_time() - time);
+  ImageDestroy(&rotated);
+
+  time = cpu_time();
+  rotated = ImageRotate270(img);
+  printf("# ImageRotate270 4000x4000: %.6f s\n", cpu_time() - time);
+  ImageDestroy(&rotated);
+
+  time = cpu_time();
+  ImageRotateInPlace(img);
+  printf("# ImageRotateInPlace 4000x4000: %.6f s\n", cpu_time() - time);
+
+  ImageDestroy(&img);
+}
+
+// Locate a subimage with a single white pixel in a black image, where it
+// only matches at the bottom right corner.
+// (Subimages with a rare level are found by scanning for that level.)
+static void benchmarkLocateRare(void) {
+  Image img = ImageCreate(2000, 2000, 255);
+  Image sub = ImageCreate(50, 50, 255);
+  ImageSetPixel(img, 1999, 1999, 255);
+  ImageSetPixel(sub, 49, 49, 255);
+
+  int x, y;
+  double time = cpu_time();
+  ImageLocateSubImage(img, &x, &y, sub);
+  printf("# ImageLocateSubImage 50x50 rare level in 2000x2000: %.6f s\n",
+         cpu_time() - time);
+
+  ImageDestroy(&sub);
+  ImageDestroy(&img);
+}
+
+// Locate the bottom right corner of a random black and white image in it,
+// with the given number of threads.
+// (Subimages with no rare level are found by hash, on multiple threads.)
+static void benchmarkLocate(int threads) {
+  Image img = ImageCreate(2000, 2000, 255);
+  unsigned int seed = 1;
+  for (int y = 0; y < 2000; y++) {
+    for (int x = 0; x < 2000; x++) {
+      seed = seed * 1103515245 + 12345;
+      ImageSetPixel(img, x, y, (seed >> 16) & 1 ? 255 : 0);
+    }
+  }
+  Image sub = ImageCrop(img, 1950, 1950, 50, 50);
+  ImageSetThreads(threads);
+
+  int x, y;
+  double time = wall_time();
+  ImageLocateSubImage(img, &x, &y, sub);
+  printf("# ImageLocateSubImage 50x50 in 2000x2000 (%d threads): %.6f s\n",
+         threads, wall_time() - time);
+
+  ImageSetThreads(0);
+  ImageDestroy(&sub);
+  ImageDestroy(&img);
+}
+
+// Locate a mirrored subimage of a random image in it, in any orientation,
+// and print the time taken.
+static void benchmarkLocateOriented(void) {
+  Image img = ImageCreate(2000, 2000, 255);
+  unsigned int seed = 1;
+  for (int y = 0; y < 2000; y++) {
+    for (int x = 0; x < 2000; x++) {
+      seed = seed * 1103515245 + 12345;
+      ImageSetPixel(img, x, y, (seed >> 16) & 255);
+    }
+  }
+  Image crop = ImageCrop(img, 1950, 1950, 50, 50);
+  Image sub = ImageMirror(crop);
+
+  int x, y, orient;
+  double time = cpu_time();
+  ImageLocateOriented(img, &x, &y, &orient, sub);
+  printf("# ImageLocateOriented 50x50 in 2000x2000: %.6f s\n",
+         cpu_time() - time);
+
+  ImageDestroy(&sub);
+  ImageDestroy(&crop);
+  ImageDestroy(&img);
+}
+
+// Find the best NCC match of subimages of increasing sizes in a random image,
+// comparing pixels and by FFT, to show where the FFT becomes faster.
+static void benchmarkLocateAll(void) {
+  const int size = 512;
+  Image img = ImageCreate(size, size, 255);
+  unsigned int seed = 1;
+  for (int y = 0; y < size; y++) {
+    for (int x = 0; x < size; x++) {
+      seed = seed * 1103515245 + 12345;
+      ImageSetPixel(img, x, y, (seed >> 16) & 255);
+    }
+  }
+
+  for (int sub_size = 8; sub_size <= 128; sub_size *= 2) {
+    Image sub = ImageCrop(img, 100, 100, sub_size, sub_size);
+    ImageMatch match;
+
+    ImageSetFFTCrossover(INFINITY);
+    double time = cpu_time();
+    ImageLocateAll(img, sub, IMAGE_NCC, 0.0, &match, 1);
+    const double spatial_time = cpu_time() - time;
+
+    ImageSetFFTCrossover(0.0);
+    time = cpu_time();
+    ImageLocateAll(img, sub, IMAGE_NCC, 0.0, &match, 1);
+    const double fft_time = cpu_time() - time;
+
+    printf("# ImageLocateAll NCC %dx%d in %dx%d: %.6f s (pixels), "
+           "%.6f s (FFT)\n",
+           sub_size, sub_size, size, size, spatial_time, fft_time);
+    ImageDestroy(&sub);
+  }
+
+  ImageSetFFTCrossover(30.0); // the default
+  ImageDestroy(&img);
+}
+
+// Load a small PGM file of size x size pixels count times, with the given
+// load function, and print the load rate.
+static void benchmarkLoad(const char *name, Image (*load)(const char *),
+                          int size, int count) {
+  const char *filename = "benchmark_tile.pgm";
+
+  Image tile = ImageCreate(size, size, 255);
+  if (tile == NULL || !ImageSave(tile, filename)) {
+    fprintf(stderr, "Failed to create %s: %s\n", filename, ImageErrMsg());
+    exit(1);
+  }
+  ImageDestroy(&tile);
+
+  double time = cpu_time();
+  for (int i = 0; i < count; i++) {
+    Image img = load(filename);
+    if (img == NULL) {
+      fprintf(stderr, "Failed to load %s: %s\n", filename, ImageErrMsg());
+      exit(1);
+    }
+    ImageDestroy(&img);
+  }
+  time = cpu_time() - time;
+
+  printf("# %s %dx%d: %d loads in %.6f s (%.0f loads/s)\n", name, size, size,
+         count, time, count / time);
+  remove(filename);
+}
+
+int main(void) {
+  ImageInit();
+
+  benchmarkBlur();
+  benchmarkBlurThreads(1);
+  benchmarkBlurThreads(0);
+  benchmarkBlurInPlace();
+  benchmarkBlurRadii();
+  benchmarkBlurRadiusMap();
+  benchmarkGaussianBlur();
+  benchmarkConvolve();
+  benchmarkMedian();
+
+  benchmarkPointOps();
+
+  benchmarkRotate();
+
+  benchmarkLocateRare();
+  benchmarkLocate(1);
+  benchmarkLocate(0);
+  benchmarkLocateOriented();
+
+  benchmarkLocateAll();
+
+  for (int size = 16; size <= 256; size *= 4) {
+    benchmarkLoad("ImageLoad", ImageLoad, size, 20000);
+    benchmarkLoad("ImageLoadMapped", ImageLoadMapped, size, 20000);
+  }
 
   return 0;
 }
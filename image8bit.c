@@ -23,10 +23,35 @@
 #include <assert.h>
 #include <ctype.h>
 #include <errno.h>
+#include <complex.h>
+#include <limits.h>
+#include <math.h>
+#include <stdatomic.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
+
+#if defined(__linux__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#define IMAGE_MMAP
+#endif
+
+#if defined(__linux__) || defined(__APPLE__)
+#include <pthread.h>
+#define IMAGE_THREADS
+#endif
+
 // The data structure
 //
 // An image is stored in a structure containing 3 fields:
@@ -39,6 +64,10 @@
 //   pixel position (x,y) = (33,0) is stored in img->pixel[33];
 //   pixel position (x,y) = (22,1) is stored in img->pixel[122].
 //
+// The pixel array is normally heap allocated, but images loaded with
+// ImageLoadMapped have it pointing into a private file mapping instead, which
+// is recorded in the mapping fields so that it can be released correctly.
+//
 // Clients should use images only through variables of type Image,
 // which are pointers to the image structure, and should not access the
 // structure fields directly.
@@ -52,6 +81,19 @@ struct image {
   int height;
   int maxval;   // maximum gray value (pixels with maxval are pure WHITE)
   uint8 *pixel; // pixel data (a raster scan)
+  void *mapping; // file mapping holding the pixel data (NULL if heap memory)
+  size_t mapping_size; // size in bytes of the file mapping
+};
+
+// The integral image (summed-area table) of an image: the sum of the levels
+// (and of their squares, if sq is not NULL) in rectangle [0, x[ x [0, y[ are
+// stored at index y * (width + 1) + x.
+struct imageIntegral {
+  int width;
+  int height;
+  int stride;   // width + 1
+  uint64_t *sum;
+  uint64_t *sq; // NULL if the squares were not summed
 };
 
 // This module follows "design-by-contract" principles.
@@ -74,10 +116,12 @@ struct image {
 // Additional information:  man 3 errno;  man 3 error;
 
 // Variable to preserve errno temporarily
-static int errsave = 0;
+// (Like errno, this and the error cause are kept per thread, so that
+// pipelines running concurrently each see their own failure.)
+static _Thread_local int errsave = 0;
 
 // Error cause
-static char *errCause;
+static _Thread_local char *errCause;
 
 /// Error cause.
 /// After some other module function fails (and returns an error code),
@@ -139,9 +183,9 @@ static int check(int condition, const char *failmsg) {
 }
 
 /// Init Image library.  (Call once!)
-/// Currently, simply calibrate instrumentation and set names of counters.
+/// Currently, simply set names of counters.
+/// (Instrumentation is calibrated only when needed, see InstrGetCTU.)
 void ImageInit(void) { ///
-  InstrCalibrate();
   InstrName[0] = "pixmem";  // InstrCount[0] will count pixel array acesses
   InstrName[1] = "greycmp"; // InstrCount[1] will count grey value comparations
   InstrName[2] = "divisions"; // InstrCount[2] will count divisions
@@ -154,6 +198,91 @@ void ImageInit(void) { ///
 #define DIVISIONS InstrCount[2]
 // Add more macros here...
 
+// Instrumentation level, selected at build time with -DIMAGE_INSTR=LEVEL:
+//   0: off, the counters are never updated;
+//   1: bulk, functions update the counters once per call, with counts
+//      computed from their loop bounds, keeping inner loops free of them;
+//   2: exact, the counters are updated at each operation (default).
+// Levels 1 and 2 give the same counts.
+#ifndef IMAGE_INSTR
+#define IMAGE_INSTR 2
+#endif
+
+// Macros to update the instrumentation counters:
+// COUNT(C, N) adds N to counter C outside of loops, in all levels but off.
+// Inside loops, use COUNT_EXACT(C, N) for each iteration and, after the loop,
+// COUNT_BULK(C, N) for all of its iterations at once.
+// When a macro is disabled, N is not evaluated, but it is still mentioned (in
+// sizeof), so that the local variables summed up only to be counted do not
+// become unused.
+#define NO_COUNT(N) ((void)sizeof(N))
+
+#if IMAGE_INSTR > 0
+#define COUNT(C, N) ((C) += (unsigned long)(N))
+#else
+#define COUNT(C, N) NO_COUNT(N)
+#endif
+
+#if IMAGE_INSTR == 1
+#define COUNT_BULK(C, N) COUNT(C, N)
+#else
+#define COUNT_BULK(C, N) NO_COUNT(N)
+#endif
+
+#if IMAGE_INSTR >= 2
+#define COUNT_EXACT(C, N) COUNT(C, N)
+#else
+#define COUNT_EXACT(C, N) NO_COUNT(N)
+#endif
+
+/// Threads
+
+// Number of threads for operations that run in parallel (0 for automatic)
+// (Atomic, as it may be set by pipelines running concurrently.)
+static atomic_int image_threads = 0;
+
+/// Set the number of threads used by the operations that run in parallel.
+/// 0 (the default) uses one thread per online processor.
+void ImageSetThreads(int threads) { ///
+  assert(threads >= 0);
+  image_threads = threads;
+}
+
+// Number of threads to use for operations that run in parallel.
+static int threadCount(void) {
+#ifdef IMAGE_THREADS
+  if (image_threads == 0) {
+    const long online = sysconf(_SC_NPROCESSORS_ONLN);
+    return online > 1 ? (int)online : 1;
+  }
+  return image_threads;
+#else
+  return 1;
+#endif
+}
+
+// Run worker(arg) on workers threads (including the calling thread), and
+// wait for all of them to finish.
+// The workers must share the work through arg, so that it is all done even
+// if some threads cannot be created (then fewer workers run).
+static void runWorkers(void *(*worker)(void *), void *arg, int workers) {
+#ifdef IMAGE_THREADS
+  pthread_t threads[workers > 1 ? workers - 1 : 1];
+  int started = 0;
+  while (started < workers - 1 &&
+         pthread_create(&threads[started], NULL, worker, arg) == 0) {
+    started++;
+  }
+  worker(arg);
+  for (int i = 0; i < started; i++) {
+    pthread_join(threads[i], NULL);
+  }
+#else
+  (void)workers;
+  worker(arg);
+#endif
+}
+
 // Helper macros for iteration over the coordinates of an image
 
 // Macro to iterate over a rect of WIDTH by HEIGHT, X and Y are the variable
@@ -186,19 +315,15 @@ void ImageInit(void) { ///
 #define FOR_COORDINATES(IMG, X, Y)                                             \
   FOR_COORDINATES_SIZED(X, Y, IMG->width, IMG->height)
 
-// TIP: Search for PIXMEM or InstrCount to see where it is incremented!
+// TIP: Search for COUNT to see where the counters are incremented!
 
 /// Image management functions
 
-/// Create a new black image.
-///   width, height : the dimensions of the new image.
-///   maxval: the maximum gray level (corresponding to white).
-/// Requires: width and height must be non-negative, maxval > 0.
-///
-/// On success, a new image is returned.
-/// (The caller is responsible for destroying the returned image!)
-/// On failure, returns NULL and errno/errCause are set accordingly.
-Image ImageCreate(int width, int height, uint8 maxval) { ///
+// Allocate a new image.
+// If clear is nonzero the image is black, otherwise the pixel levels are left
+// uninitialized, for callers that will overwrite all of them anyway.
+// This is an internal function, see ImageCreate for the contract.
+static Image ImageAllocate(int width, int height, uint8 maxval, int clear) {
   assert(width >= 0);
   assert(height >= 0);
   assert(0 < maxval && maxval <= PixMax);
@@ -209,7 +334,8 @@ Image ImageCreate(int width, int height, uint8 maxval) { ///
     return NULL;
 
   // Allocate the pixel data buffer
-  uint8 *pixel = (uint8 *)calloc(width * height, sizeof(uint8));
+  uint8 *pixel = clear ? (uint8 *)calloc(width * height, sizeof(uint8))
+                       : (uint8 *)malloc(width * height * sizeof(uint8));
   if (check(pixel == NULL, "Failed to allocate pixel data")) {
     // The image still was allocated so it needs to be freed
     free(image);
@@ -220,10 +346,40 @@ Image ImageCreate(int width, int height, uint8 maxval) { ///
   image->height = height;
   image->maxval = maxval;
   image->pixel = pixel;
+  image->mapping = NULL;
+  image->mapping_size = 0;
 
   return image;
 }
 
+/// Create a new black image.
+///   width, height : the dimensions of the new image.
+///   maxval: the maximum gray level (corresponding to white).
+/// Requires: width and height must be non-negative, maxval > 0.
+///
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+Image ImageCreate(int width, int height, uint8 maxval) { ///
+  return ImageAllocate(width, height, maxval, 1);
+}
+
+// Release the memory backing the pixel data of img.
+// The pixel data is either heap memory or part of a file mapping (see
+// ImageLoadMapped), each needs to be released in its own way.
+// This is an internal function.
+static void ImageReleasePixels(Image img) {
+#ifdef IMAGE_MMAP
+  if (img->mapping != NULL) {
+    munmap(img->mapping, img->mapping_size);
+    img->mapping = NULL;
+    img->mapping_size = 0;
+    return;
+  }
+#endif
+  free(img->pixel);
+}
+
 /// Destroy the image pointed to by (*imgp).
 ///   imgp : address of an Image variable.
 /// If (*imgp)==NULL, no operation is performed.
@@ -235,7 +391,7 @@ void ImageDestroy(Image *imgp) { ///
   if (*imgp == NULL)
     return;
 
-  free((*imgp)->pixel);
+  ImageReleasePixels(*imgp);
   free(*imgp);
   *imgp = NULL;
 }
@@ -245,16 +401,82 @@ void ImageDestroy(Image *imgp) { ///
 // See also:
 // PGM format specification: http://netpbm.sourceforge.net/doc/pgm.html
 
-// Match and skip 0 or more comment lines in file f.
+// Size of the block read at once by ImageLoad.
+// The whole header must fit in this block (which only excludes files with
+// kilobytes of comments), and for small images the pixels also fit in it, so
+// that loading them takes a single read.
+#define LOAD_BLOCK_SIZE 4096
+
+// Skip 0 or more whitespace characters and comments in the header buffer,
+// starting at pos.
 // Comments start with a # and continue until the end-of-line, inclusive.
-// Returns the number of comments skipped.
-static int skipComments(FILE *f) {
-  char c;
-  int i = 0;
-  while (fscanf(f, "#%*[^\n]%c", &c) == 1 && c == '\n') {
-    i++;
+// Returns the position of the first character that was not skipped.
+static size_t skipSpace(const uint8 *buf, size_t len, size_t pos) {
+  while (pos < len) {
+    if (buf[pos] == '#') {
+      while (pos < len && buf[pos] != '\n' && buf[pos] != '\r')
+        pos++;
+    } else if (isspace(buf[pos])) {
+      pos++;
+    } else {
+      break;
+    }
   }
-  return i;
+  return pos;
+}
+
+// Parse a non-negative decimal number from the header buffer at (*pos),
+// preceded by whitespace and/or comments.
+// On success, returns nonzero, stores the number in (*value) and advances
+// (*pos) past it. On failure, returns 0.
+static int parseNumber(const uint8 *buf, size_t len, size_t *pos, int *value) {
+  size_t p = skipSpace(buf, len, *pos);
+  if (p == *pos || p >= len || !isdigit(buf[p]))
+    return 0;
+
+  long number = 0;
+  for (; p < len && isdigit(buf[p]); p++) {
+    number = number * 10 + (buf[p] - '0');
+    if (number > INT_MAX)
+      return 0;
+  }
+
+  *value = (int)number;
+  *pos = p;
+  return 1;
+}
+
+// Parse the header of a raw PGM file stored in the first len bytes of buf.
+// This does the whole parsing in a single pass over the buffer, so it can be
+// used both on a block read from the file and on a file mapping.
+// On success, returns nonzero, the dimensions and maxval are stored in
+// (*w, *h, *maxval) and the position of the first pixel in (*offset).
+// On failure, returns 0 and errCause is set accordingly.
+static int parseHeader(const uint8 *buf, size_t len, int *w, int *h,
+                       int *maxval, size_t *offset) {
+  size_t pos = 2;
+  int success =
+      check(len >= 2 && buf[0] == 'P' && buf[1] == '5',
+            "Invalid file format") &&
+      check(parseNumber(buf, len, &pos, w), "Invalid width") &&
+      check(parseNumber(buf, len, &pos, h), "Invalid height") &&
+      check(parseNumber(buf, len, &pos, maxval) && 0 < *maxval &&
+                *maxval <= (int)PixMax,
+            "Invalid maxval");
+  if (!success)
+    return 0;
+
+  // A comment may still appear before the single whitespace character that
+  // separates the header from the pixels.
+  if (pos < len && buf[pos] == '#') {
+    while (pos < len && buf[pos] != '\n' && buf[pos] != '\r')
+      pos++;
+  }
+  if (!check(pos < len && isspace(buf[pos]), "Whitespace expected"))
+    return 0;
+
+  *offset = pos + 1;
+  return 1;
 }
 
 /// Load a raw PGM file.
@@ -263,31 +485,40 @@ static int skipComments(FILE *f) {
 /// (The caller is responsible for destroying the returned image!)
 /// On failure, returns NULL and errno/errCause are set accordingly.
 Image ImageLoad(const char *filename) { ///
-  int w, h;
+  int w = 0, h = 0;
   int maxval;
-  char c;
+  uint8 block[LOAD_BLOCK_SIZE];
+  size_t len = 0;
+  size_t offset;
   FILE *f = NULL;
   Image img = NULL;
 
+  // The header and the start of the pixels are read in one block, and the
+  // rest of the pixels (if any) directly into the image, so the stream is
+  // left unbuffered to avoid copying everything through the stdio buffer.
   int success =
       check((f = fopen(filename, "rb")) != NULL, "Open failed") &&
+      check(setvbuf(f, NULL, _IONBF, 0) == 0, "Open failed") &&
+      check((len = fread(block, sizeof(uint8), sizeof(block), f)) > 0,
+            "Invalid file format") &&
       // Parse PGM header
-      check(fscanf(f, "P%c ", &c) == 1 && c == '5', "Invalid file format") &&
-      skipComments(f) >= 0 &&
-      check(fscanf(f, "%d ", &w) == 1 && w >= 0, "Invalid width") &&
-      skipComments(f) >= 0 &&
-      check(fscanf(f, "%d ", &h) == 1 && h >= 0, "Invalid height") &&
-      skipComments(f) >= 0 &&
-      check(fscanf(f, "%d", &maxval) == 1 && 0 < maxval &&
-                maxval <= (int)PixMax,
-            "Invalid maxval") &&
-      check(fscanf(f, "%c", &c) == 1 && isspace(c), "Whitespace expected") &&
-      // Allocate image
-      (img = ImageCreate(w, h, (uint8)maxval)) != NULL &&
-      // Read pixels
-      check(fread(img->pixel, sizeof(uint8), w * h, f) == w * h,
-            "Reading pixels");
-  PIXMEM += (unsigned long)(w * h); // count pixel memory accesses
+      parseHeader(block, len, &w, &h, &maxval, &offset) &&
+      // Allocate image, there's no need to clear it since every pixel will
+      // be overwritten.
+      (img = ImageAllocate(w, h, (uint8)maxval, 0)) != NULL;
+
+  if (success) {
+    // Copy the pixels that came along with the header and read the rest
+    const size_t num_pixels = (size_t)w * h;
+    const size_t in_block =
+        len - offset < num_pixels ? len - offset : num_pixels;
+    memcpy(img->pixel, block + offset, in_block);
+    success = check(fread(img->pixel + in_block, sizeof(uint8),
+                          num_pixels - in_block,
+                          f) == num_pixels - in_block,
+                    "Reading pixels");
+  }
+  COUNT(PIXMEM, w * h); // count pixel memory accesses
 
   // Cleanup
   if (!success) {
@@ -300,6 +531,64 @@ Image ImageLoad(const char *filename) { ///
   return img;
 }
 
+/// Load a raw PGM file by mapping it into memory.
+/// Only 8 bit PGM files are accepted.
+/// Instead of reading the pixels into a new buffer, the file is mapped
+/// privately (copy-on-write) and the image pixels point into the mapping, so
+/// loading costs are only paid for the pages that are actually accessed.
+/// Operations that modify the image in-place never change the file.
+/// On systems without memory mapping support this behaves like ImageLoad.
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+Image ImageLoadMapped(const char *filename) { ///
+#ifdef IMAGE_MMAP
+  int w, h;
+  int maxval;
+  size_t offset;
+  struct stat st;
+  int fd = -1;
+  Image img = NULL;
+  void *mapping = MAP_FAILED;
+
+  int success =
+      check((fd = open(filename, O_RDONLY)) >= 0, "Open failed") &&
+      check(fstat(fd, &st) == 0, "Open failed") &&
+      check(st.st_size > 0, "Invalid file format") &&
+      // Map the whole file, the offset of a mapping must be page aligned so
+      // the header is also included in it.
+      check((mapping = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE,
+                            MAP_PRIVATE, fd, 0)) != MAP_FAILED,
+            "Mapping file failed") &&
+      // Parse PGM header, straight from the mapping
+      parseHeader((const uint8 *)mapping, st.st_size, &w, &h, &maxval,
+                  &offset) &&
+      check(st.st_size - offset >= (size_t)w * h, "Reading pixels") &&
+      check((img = (Image)malloc(sizeof(struct image))) != NULL,
+            "Failed to allocate image");
+
+  if (success) {
+    img->width = w;
+    img->height = h;
+    img->maxval = maxval;
+    img->pixel = (uint8 *)mapping + offset;
+    img->mapping = mapping;
+    img->mapping_size = st.st_size;
+  } else if (mapping != MAP_FAILED) {
+    errsave = errno;
+    munmap(mapping, st.st_size);
+    errno = errsave;
+  }
+
+  // Cleanup
+  if (fd >= 0)
+    close(fd);
+  return img;
+#else
+  return ImageLoad(filename);
+#endif
+}
+
 /// Save image to PGM file.
 /// On success, returns nonzero.
 /// On failure, returns 0, errno/errCause are set appropriately, and
@@ -316,7 +605,7 @@ int ImageSave(Image img, const char *filename) { ///
                       "Writing header failed") &&
                 check(fwrite(img->pixel, sizeof(uint8), w * h, f) == w * h,
                       "Writing pixels failed");
-  PIXMEM += (unsigned long)(w * h); // count pixel memory accesses
+  COUNT(PIXMEM, w * h); // count pixel memory accesses
 
   // Cleanup
   if (f != NULL)
@@ -361,7 +650,7 @@ void ImageStats(Image img, uint8 *min, uint8 *max) { ///
   *min = *max = ImageGetPixel(img, 0, 0);
 
   for (int i = 1; i < num_pixels; i++) {
-    PIXMEM++; // count one pixel access (read)
+    COUNT_EXACT(PIXMEM, 1); // count one pixel access (read)
     const uint8 level = img->pixel[i];
 
     if (level > *max) {
@@ -370,6 +659,7 @@ void ImageStats(Image img, uint8 *min, uint8 *max) { ///
       *min = level;
     }
   }
+  COUNT_BULK(PIXMEM, num_pixels - 1);
 }
 
 /// Check if pixel position (x,y) is inside img.
@@ -406,6 +696,18 @@ static inline int G(Image img, int x, int y) {
   return index;
 }
 
+// Get the pixel (level) at position (x,y), without counting the access.
+// This internal function is used in loops that count their accesses.
+static inline uint8 getPixel(Image img, int x, int y) {
+  return img->pixel[G(img, x, y)];
+}
+
+// Set the pixel at position (x,y) to new level, without counting the access.
+// This internal function is used in loops that count their accesses.
+static inline void setPixel(Image img, int x, int y, uint8 level) {
+  img->pixel[G(img, x, y)] = level;
+}
+
 /// Clamps the value to be between min and max
 /// This is an internal function.
 static int clamp(int val, int min, int max) {
@@ -415,8 +717,8 @@ static int clamp(int val, int min, int max) {
 
 /// Calculates the integer division between the numerator
 /// and denominator respectively, rounding the result.
+/// (The callers count the divisions.)
 static inline int round_div(int num, int denom) {
-  DIVISIONS++;
   return (int)((double)num / (double)denom + 0.5);
 }
 
@@ -424,16 +726,16 @@ static inline int round_div(int num, int denom) {
 uint8 ImageGetPixel(Image img, int x, int y) { ///
   assert(img != NULL);
   assert(ImageValidPos(img, x, y));
-  PIXMEM += 1; // count one pixel access (read)
-  return img->pixel[G(img, x, y)];
+  COUNT(PIXMEM, 1); // count one pixel access (read)
+  return getPixel(img, x, y);
 }
 
 /// Set the pixel at position (x,y) to new level.
 void ImageSetPixel(Image img, int x, int y, uint8 level) { ///
   assert(img != NULL);
   assert(ImageValidPos(img, x, y));
-  PIXMEM += 1; // count one pixel access (store)
-  img->pixel[G(img, x, y)] = level;
+  COUNT(PIXMEM, 1); // count one pixel access (store)
+  setPixel(img, x, y, level);
 }
 
 /// Pixel transformations
@@ -443,16 +745,43 @@ void ImageSetPixel(Image img, int x, int y, uint8 level) { ///
 /// All of these functions modify the image in-place: no allocation involved.
 /// They never fail.
 
+// The pixel transformations below are implemented with SIMD instructions
+// when the compiler targets them (SSE2 is always available on x86-64, AVX2
+// must be enabled with -mavx2 or -march=native), processing 16 or 32 pixels
+// at once, with a scalar loop for the remaining pixels.
+// Since these loops no longer touch the instrumentation counters for every
+// pixel, the pixel accesses are counted in bulk.
+
 /// Transform image to negative image.
 /// This transforms dark pixels to light pixels and vice-versa,
 /// resulting in a "photographic negative" effect.
 void ImageNegative(Image img) { ///
   assert(img != NULL);
   const size_t num_pixels = ImageArea(img);
-  for (size_t i = 0; i < num_pixels; i++) {
-    PIXMEM += 2; // count two pixels accesses (1 read and 1 write)
-    img->pixel[i] = img->maxval - img->pixel[i];
+  const uint8 maxval = img->maxval;
+  uint8 *pixel = img->pixel;
+  size_t i = 0;
+
+#ifdef __AVX2__
+  const __m256i maxval32 = _mm256_set1_epi8((char)maxval);
+  for (; i + 32 <= num_pixels; i += 32) {
+    const __m256i level = _mm256_loadu_si256((const __m256i *)(pixel + i));
+    _mm256_storeu_si256((__m256i *)(pixel + i),
+                        _mm256_sub_epi8(maxval32, level));
+  }
+#endif
+#ifdef __SSE2__
+  const __m128i maxval16 = _mm_set1_epi8((char)maxval);
+  for (; i + 16 <= num_pixels; i += 16) {
+    const __m128i level = _mm_loadu_si128((const __m128i *)(pixel + i));
+    _mm_storeu_si128((__m128i *)(pixel + i), _mm_sub_epi8(maxval16, level));
   }
+#endif
+  for (; i < num_pixels; i++) {
+    pixel[i] = maxval - pixel[i];
+  }
+
+  COUNT(PIXMEM, 2 * num_pixels); // count two pixels accesses each
 }
 
 /// Apply threshold to image.
@@ -461,10 +790,58 @@ void ImageNegative(Image img) { ///
 void ImageThreshold(Image img, uint8 thr) { ///
   assert(img != NULL);
   const size_t num_pixels = ImageArea(img);
-  for (size_t i = 0; i < num_pixels; i++) {
-    PIXMEM += 2; // count two pixels accesses (1 read and 1 write)
-    const int current_value = img->pixel[i];
-    img->pixel[i] = current_value >= thr ? img->maxval : 0;
+  const uint8 maxval = img->maxval;
+  uint8 *pixel = img->pixel;
+  size_t i = 0;
+
+  // There are no unsigned byte comparisons in SSE2/AVX2, instead
+  // level >= thr is tested as max(level, thr) == level, which gives a mask
+  // with all bits set where it holds, used to select maxval.
+#ifdef __AVX2__
+  const __m256i thr32 = _mm256_set1_epi8((char)thr);
+  const __m256i maxval32 = _mm256_set1_epi8((char)maxval);
+  for (; i + 32 <= num_pixels; i += 32) {
+    const __m256i level = _mm256_loadu_si256((const __m256i *)(pixel + i));
+    const __m256i mask =
+        _mm256_cmpeq_epi8(_mm256_max_epu8(level, thr32), level);
+    _mm256_storeu_si256((__m256i *)(pixel + i),
+                        _mm256_and_si256(mask, maxval32));
+  }
+#endif
+#ifdef __SSE2__
+  const __m128i thr16 = _mm_set1_epi8((char)thr);
+  const __m128i maxval16 = _mm_set1_epi8((char)maxval);
+  for (; i + 16 <= num_pixels; i += 16) {
+    const __m128i level = _mm_loadu_si128((const __m128i *)(pixel + i));
+    const __m128i mask = _mm_cmpeq_epi8(_mm_max_epu8(level, thr16), level);
+    _mm_storeu_si128((__m128i *)(pixel + i), _mm_and_si128(mask, maxval16));
+  }
+#endif
+  for (; i < num_pixels; i++) {
+    pixel[i] = pixel[i] >= thr ? maxval : 0;
+  }
+
+  COUNT(PIXMEM, 2 * num_pixels); // count two pixels accesses each
+}
+
+// Replace each pixel level of the n pixels in pixel by lut[level].
+// This is an internal function.
+static void applyLUT(uint8 *pixel, size_t n, const uint8 lut[256]) {
+  size_t i = 0;
+  // Unrolled so that the loads of consecutive pixels and table entries
+  // are independent of each other.
+  for (; i + 4 <= n; i += 4) {
+    const uint8 a = lut[pixel[i]];
+    const uint8 b = lut[pixel[i + 1]];
+    const uint8 c = lut[pixel[i + 2]];
+    const uint8 d = lut[pixel[i + 3]];
+    pixel[i] = a;
+    pixel[i + 1] = b;
+    pixel[i + 2] = c;
+    pixel[i + 3] = d;
+  }
+  for (; i < n; i++) {
+    pixel[i] = lut[pixel[i]];
   }
 }
 
@@ -475,16 +852,67 @@ void ImageThreshold(Image img, uint8 thr) { ///
 void ImageBrighten(Image img, double factor) { ///
   assert(img != NULL);
   assert(factor >= 0.0);
-  const size_t num_pixels = ImageArea(img);
-  for (size_t i = 0; i < num_pixels; i++) {
-    PIXMEM += 2; // count two pixels accesses (1 read and 1 write)
-    const int current_value = img->pixel[i];
+
+  // There are only 256 possible levels, so instead of multiplying and
+  // clamping every pixel, the result for each level is computed once into a
+  // lookup table, which is then applied to all pixels.
+  uint8 lut[256];
+  ImageIdentityLUT(lut);
+  ImageBrightenLUT(img, lut, factor);
+  ImageApplyLUT(img, lut);
+}
+
+/// Lookup tables
+
+/// Each pixel transformation maps every level to a new level, regardless of
+/// the pixel position, so it can be described by a 256-entry lookup table
+/// (LUT), where lut[level] is the new level.
+/// A chain of pixel transformations can then be applied in a single pass
+/// over the image, by composing their tables and applying the result.
+
+/// Set lut to the identity table (lut[level] == level).
+void ImageIdentityLUT(uint8 lut[256]) { ///
+  for (int level = 0; level < 256; level++) {
+    lut[level] = (uint8)level;
+  }
+}
+
+/// Compose ImageNegative (for img) after the transformation in lut.
+void ImageNegativeLUT(Image img, uint8 lut[256]) { ///
+  assert(img != NULL);
+  for (int level = 0; level < 256; level++) {
+    lut[level] = img->maxval - lut[level];
+  }
+}
+
+/// Compose ImageThreshold (for img) after the transformation in lut.
+void ImageThresholdLUT(Image img, uint8 lut[256], uint8 thr) { ///
+  assert(img != NULL);
+  for (int level = 0; level < 256; level++) {
+    lut[level] = lut[level] >= thr ? img->maxval : 0;
+  }
+}
+
+/// Compose ImageBrighten (for img) after the transformation in lut.
+void ImageBrightenLUT(Image img, uint8 lut[256], double factor) { ///
+  assert(img != NULL);
+  assert(factor >= 0.0);
+  for (int level = 0; level < 256; level++) {
     // Add +0.5 for rounding
-    const int updated_value = (int)((double)current_value * factor + 0.5);
-    img->pixel[i] = clamp(updated_value, 0, img->maxval);
+    const int updated_value = (int)((double)lut[level] * factor + 0.5);
+    lut[level] = clamp(updated_value, 0, img->maxval);
   }
 }
 
+/// Apply a lookup table to image.
+/// Transform each pixel level into lut[level].
+void ImageApplyLUT(Image img, const uint8 lut[256]) { ///
+  assert(img != NULL);
+  const size_t num_pixels = ImageArea(img);
+  applyLUT(img->pixel, num_pixels, lut);
+  COUNT(PIXMEM, 2 * num_pixels); // count two pixels accesses each
+}
+
 /// Geometric transformations
 
 /// These functions apply geometric transformations to an image,
@@ -498,6 +926,148 @@ void ImageBrighten(Image img, double factor) { ///
 // Implementation hint:
 // Call ImageCreate whenever you need a new image!
 
+// Side of the square tiles in which the transposes are done.
+// A tile of the source and one of the destination must fit in the L1 cache.
+#define TRANSPOSE_TILE 64
+
+// Transpose the 8x8 block at src (rows src_stride bytes apart) into dst (rows
+// dst_stride bytes apart).
+// All of the block is read before it is written, so src and dst may be the
+// same block.
+static inline void transpose8x8(uint8 *dst, ptrdiff_t dst_stride,
+                                const uint8 *src, ptrdiff_t src_stride) {
+#ifdef __SSE2__
+  __m128i r[8];
+  for (int i = 0; i < 8; i++) {
+    r[i] = _mm_loadl_epi64((const __m128i *)(src + i * src_stride));
+  }
+  // Interleave bytes, words and then double words of pairs of rows, so that
+  // each register ends up holding two columns.
+  const __m128i b0 = _mm_unpacklo_epi8(r[0], r[1]);
+  const __m128i b1 = _mm_unpacklo_epi8(r[2], r[3]);
+  const __m128i b2 = _mm_unpacklo_epi8(r[4], r[5]);
+  const __m128i b3 = _mm_unpacklo_epi8(r[6], r[7]);
+  const __m128i w0 = _mm_unpacklo_epi16(b0, b1);
+  const __m128i w1 = _mm_unpackhi_epi16(b0, b1);
+  const __m128i w2 = _mm_unpacklo_epi16(b2, b3);
+  const __m128i w3 = _mm_unpackhi_epi16(b2, b3);
+  const __m128i col[4] = {
+      _mm_unpacklo_epi32(w0, w2), // columns 0 and 1
+      _mm_unpackhi_epi32(w0, w2), // columns 2 and 3
+      _mm_unpacklo_epi32(w1, w3), // columns 4 and 5
+      _mm_unpackhi_epi32(w1, w3), // columns 6 and 7
+  };
+  for (int i = 0; i < 4; i++) {
+    _mm_storel_epi64((__m128i *)(dst + (2 * i) * dst_stride), col[i]);
+    _mm_storel_epi64((__m128i *)(dst + (2 * i + 1) * dst_stride),
+                     _mm_unpackhi_epi64(col[i], col[i]));
+  }
+#else
+  uint8 block[8][8];
+  for (int y = 0; y < 8; y++) {
+    for (int x = 0; x < 8; x++) {
+      block[x][y] = src[y * src_stride + x];
+    }
+  }
+  for (int x = 0; x < 8; x++) {
+    memcpy(dst + x * dst_stride, block[x], 8);
+  }
+#endif
+}
+
+// Transpose the w by h pixels at src (rows src_stride bytes apart) into dst
+// (rows dst_stride bytes apart), that is:
+//   dst[x * dst_stride + y] = src[y * src_stride + x]
+// Strides may be negative, to flip the source or destination vertically.
+//
+// Walking the source by rows would write the destination by columns, missing
+// the cache on every write of a large image. Instead, the 8x8 blocks are
+// transposed TRANSPOSE_TILE by TRANSPOSE_TILE tiles at a time, so that the
+// lines of both tiles stay in cache, and the leftover pixels after the last
+// whole block of each row and column are transposed one by one.
+static void transpose(uint8 *dst, ptrdiff_t dst_stride, const uint8 *src,
+                      ptrdiff_t src_stride, int w, int h) {
+  const int w8 = w & ~7;
+  const int h8 = h & ~7;
+
+  for (int ty = 0; ty < h8; ty += TRANSPOSE_TILE) {
+    const int ty_end = ty + TRANSPOSE_TILE < h8 ? ty + TRANSPOSE_TILE : h8;
+    for (int tx = 0; tx < w8; tx += TRANSPOSE_TILE) {
+      const int tx_end = tx + TRANSPOSE_TILE < w8 ? tx + TRANSPOSE_TILE : w8;
+      for (int y = ty; y < ty_end; y += 8) {
+        for (int x = tx; x < tx_end; x += 8) {
+          transpose8x8(dst + x * dst_stride + y, dst_stride,
+                       src + y * src_stride + x, src_stride);
+        }
+      }
+    }
+  }
+
+  for (int y = 0; y < h; y++) {
+    for (int x = y < h8 ? w8 : 0; x < w; x++) {
+      dst[x * dst_stride + y] = src[y * src_stride + x];
+    }
+  }
+}
+
+// Transpose the n by n pixels at pixel in place.
+// Pairs of 8x8 blocks symmetric about the diagonal are swapped (transposing
+// both), by tiles as in transpose; the leftover pixels are swapped one by one.
+static void transposeInPlace(uint8 *pixel, int n) {
+  const int n8 = n & ~7;
+
+  for (int ty = 0; ty < n8; ty += TRANSPOSE_TILE) {
+    const int ty_end = ty + TRANSPOSE_TILE < n8 ? ty + TRANSPOSE_TILE : n8;
+    for (int tx = ty; tx < n8; tx += TRANSPOSE_TILE) {
+      const int tx_end = tx + TRANSPOSE_TILE < n8 ? tx + TRANSPOSE_TILE : n8;
+      for (int y = ty; y < ty_end; y += 8) {
+        for (int x = tx == ty ? y : tx; x < tx_end; x += 8) {
+          uint8 *upper = pixel + (ptrdiff_t)y * n + x;
+          uint8 *lower = pixel + (ptrdiff_t)x * n + y;
+          if (upper == lower) {
+            transpose8x8(upper, n, upper, n);
+          } else {
+            uint8 block[8 * 8];
+            transpose8x8(block, 8, upper, n);
+            transpose8x8(upper, n, lower, n);
+            for (int i = 0; i < 8; i++) {
+              memcpy(lower + i * n, block + i * 8, 8);
+            }
+          }
+        }
+      }
+    }
+  }
+
+  for (int y = 0; y < n; y++) {
+    for (int x = y < n8 ? n8 : y + 1; x < n; x++) {
+      const uint8 level = pixel[(ptrdiff_t)y * n + x];
+      pixel[(ptrdiff_t)y * n + x] = pixel[(ptrdiff_t)x * n + y];
+      pixel[(ptrdiff_t)x * n + y] = level;
+    }
+  }
+}
+
+// Copy the n pixels at src into dst in reverse order
+// (dst[i] = src[n - 1 - i]).
+static void reverseCopy(uint8 *dst, const uint8 *src, size_t n) {
+  size_t i = 0;
+#ifdef __SSE2__
+  for (; i + 16 <= n; i += 16) {
+    __m128i v = _mm_loadu_si128((const __m128i *)(src + n - 16 - i));
+    // Swap the bytes of each word, then reverse the words.
+    v = _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8));
+    v = _mm_shufflelo_epi16(v, _MM_SHUFFLE(0, 1, 2, 3));
+    v = _mm_shufflehi_epi16(v, _MM_SHUFFLE(0, 1, 2, 3));
+    v = _mm_shuffle_epi32(v, _MM_SHUFFLE(1, 0, 3, 2));
+    _mm_storeu_si128((__m128i *)(dst + i), v);
+  }
+#endif
+  for (; i < n; i++) {
+    dst[i] = src[n - 1 - i];
+  }
+}
+
 /// Rotate an image.
 /// Returns a rotated version of the image.
 /// The rotation is 90 degrees anti-clockwise.
@@ -510,8 +1080,8 @@ Image ImageRotate(Image img) { ///
   assert(img != NULL);
 
   // The width and height will be swapped since the image is rotated
-  const Image new_img = ImageCreate(img->height, img->width, img->maxval);
-  // The errno and errCause from ImageCreate will be propagated
+  const Image new_img = ImageAllocate(img->height, img->width, img->maxval, 0);
+  // The errno and errCause from ImageAllocate will be propagated
   if (new_img == NULL)
     return NULL;
 
@@ -521,18 +1091,103 @@ Image ImageRotate(Image img) { ///
   //
   // f(x, y) := (y, H - x - 1)
   //
-  // Where the H is the image height.
+  // Where the H is the new image height.
+  //
+  // This is a transpose into the new image, starting from its last row and
+  // going up.
+  if (ImageArea(img) > 0) {
+    const int h = new_img->height;
+    transpose(new_img->pixel + (ptrdiff_t)(h - 1) * new_img->width,
+              -(ptrdiff_t)new_img->width, img->pixel, img->width, img->width,
+              img->height);
+  }
+  COUNT(PIXMEM, 2 * ImageArea(img)); // count two pixel accesses each
 
-  FOR_COORDINATES(img, x, y) {
-    const int new_x = y;
-    const int new_y = new_img->height - x - 1;
-    const uint8 level = ImageGetPixel(img, x, y);
-    ImageSetPixel(new_img, new_x, new_y, level);
+  return new_img;
+}
+
+/// Rotate an image by 180 degrees.
+/// Returns a rotated version of the image.
+/// Ensures: The original img is not modified.
+///
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+Image ImageRotate180(Image img) { ///
+  assert(img != NULL);
+
+  const Image new_img = ImageAllocate(img->width, img->height, img->maxval, 0);
+  // The errno and errCause from ImageAllocate will be propagated
+  if (new_img == NULL)
+    return NULL;
+
+  // f(x, y) := (W - x - 1, H - y - 1)
+  //
+  // Since the pixels are stored line by line, this simply reverses the order
+  // of all pixels.
+  const size_t num_pixels = ImageArea(img);
+  reverseCopy(new_img->pixel, img->pixel, num_pixels);
+  COUNT(PIXMEM, 2 * num_pixels); // count two pixel accesses each
+
+  return new_img;
+}
+
+/// Rotate an image by 270 degrees anti-clockwise (90 degrees clockwise).
+/// Returns a rotated version of the image.
+/// Ensures: The original img is not modified.
+///
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+Image ImageRotate270(Image img) { ///
+  assert(img != NULL);
+
+  // The width and height will be swapped since the image is rotated
+  const Image new_img = ImageAllocate(img->height, img->width, img->maxval, 0);
+  // The errno and errCause from ImageAllocate will be propagated
+  if (new_img == NULL)
+    return NULL;
+
+  // f(x, y) := (W - y - 1, x)
+  //
+  // Where the W is the new image width.
+  //
+  // This is a transpose of the image, starting from its last row and going
+  // up, into the new image.
+  if (ImageArea(img) > 0) {
+    transpose(new_img->pixel, new_img->width,
+              img->pixel + (ptrdiff_t)(img->height - 1) * img->width,
+              -(ptrdiff_t)img->width, img->width, img->height);
   }
+  COUNT(PIXMEM, 2 * ImageArea(img)); // count two pixel accesses each
 
   return new_img;
 }
 
+/// Rotate a square image in place.
+/// The rotation is 90 degrees anti-clockwise, as in ImageRotate, but img is
+/// modified instead of allocating a new image.
+/// Requires: img must be square (width == height).
+void ImageRotateInPlace(Image img) { ///
+  assert(img != NULL);
+  assert(img->width == img->height);
+
+  // A rotation is a transpose followed by a vertical flip.
+  const int n = img->width;
+  transposeInPlace(img->pixel, n);
+  for (int y = 0; y < n / 2; y++) {
+    uint8 *top = img->pixel + (ptrdiff_t)y * n;
+    uint8 *bottom = img->pixel + (ptrdiff_t)(n - 1 - y) * n;
+    for (int x = 0; x < n; x++) {
+      const uint8 level = top[x];
+      top[x] = bottom[x];
+      bottom[x] = level;
+    }
+  }
+  // count two pixel accesses each, for the transpose and the flip
+  COUNT(PIXMEM, 4 * ImageArea(img));
+}
+
 /// Mirror an image = flip left-right.
 /// Returns a mirrored version of the image.
 /// Ensures: The original img is not modified.
@@ -549,9 +1204,11 @@ Image ImageMirror(Image img) {
     return NULL;
 
   FOR_COORDINATES(img, x, y) {
-    const uint8 level = ImageGetPixel(img, x, y);
-    ImageSetPixel(new_img, img->width - x - 1, y, level);
+    const uint8 level = getPixel(img, x, y);
+    setPixel(new_img, img->width - x - 1, y, level);
+    COUNT_EXACT(PIXMEM, 2); // count two pixel accesses
   }
+  COUNT_BULK(PIXMEM, 2 * ImageArea(img));
 
   return new_img;
 }
@@ -578,9 +1235,11 @@ Image ImageCrop(Image img, int x, int y, int w, int h) { ///
     return NULL;
 
   FOR_COORDINATES_SIZED(new_x, new_y, w, h) {
-    const uint8 level = ImageGetPixel(img, new_x + x, new_y + y);
-    ImageSetPixel(new_img, new_x, new_y, level);
+    const uint8 level = getPixel(img, new_x + x, new_y + y);
+    setPixel(new_img, new_x, new_y, level);
+    COUNT_EXACT(PIXMEM, 2); // count two pixel accesses
   }
+  COUNT_BULK(PIXMEM, 2 * ImageArea(new_img));
 
   return new_img;
 }
@@ -597,9 +1256,11 @@ void ImagePaste(Image img1, int x, int y, Image img2) { ///
   assert(ImageValidRect(img1, x, y, img2->width, img2->height));
 
   FOR_COORDINATES(img2, new_x, new_y) {
-    const uint8 level = ImageGetPixel(img2, new_x, new_y);
-    ImageSetPixel(img1, new_x + x, new_y + y, level);
+    const uint8 level = getPixel(img2, new_x, new_y);
+    setPixel(img1, new_x + x, new_y + y, level);
+    COUNT_EXACT(PIXMEM, 2); // count two pixel accesses
   }
+  COUNT_BULK(PIXMEM, 2 * ImageArea(img2));
 }
 
 /// Blend an image into a larger image.
@@ -617,15 +1278,57 @@ void ImageBlend(Image img1, int x, int y, Image img2, double alpha) { ///
     const int old_x = new_x + x;
     const int old_y = new_y + y;
 
-    const int img2_value = ImageGetPixel(img1, old_x, old_y);
-    const int img1_value = ImageGetPixel(img2, new_x, new_y);
+    const int img2_value = getPixel(img1, old_x, old_y);
+    const int img1_value = getPixel(img2, new_x, new_y);
 
     const int updated_value = (int)((double)img1_value * alpha +
                                     (double)img2_value * (1 - alpha) + 0.5);
     const int clamped_value = clamp(updated_value, 0, img1->maxval);
 
-    ImageSetPixel(img1, old_x, old_y, clamped_value);
+    setPixel(img1, old_x, old_y, clamped_value);
+    COUNT_EXACT(PIXMEM, 3); // count three pixel accesses
+  }
+  COUNT_BULK(PIXMEM, 3 * ImageArea(img2));
+}
+
+// Returns the index of the first of the n pixels at a and b that differ, or
+// n if they are all equal.
+static inline size_t mismatch(const uint8 *a, const uint8 *b, size_t n) {
+  size_t i = 0;
+#ifdef __SSE2__
+  for (; i + 16 <= n; i += 16) {
+    const __m128i va = _mm_loadu_si128((const __m128i *)(a + i));
+    const __m128i vb = _mm_loadu_si128((const __m128i *)(b + i));
+    const unsigned differ = ~_mm_movemask_epi8(_mm_cmpeq_epi8(va, vb)) & 0xFFFF;
+    if (differ != 0)
+      return i + __builtin_ctz(differ);
+  }
+#endif
+  while (i < n && a[i] == b[i])
+    i++;
+  return i;
+}
+
+// Compare img2 to the subimage of img1 at (x, y), which must fit in img1.
+// Returns 1 if they match, 0 otherwise, and adds the number of pixels
+// compared to (*compared), so that callers running in parallel can count
+// them without sharing the counters.
+// Rows are contiguous in memory, so they are compared a whole row at a time.
+// This is an internal function, used by ImageMatchSubImage and the searches.
+static inline int matchAt(Image img1, int x, int y, Image img2,
+                          unsigned long *compared) {
+  const size_t w = img2->width;
+  for (int row = 0; row < img2->height; row++) {
+    const size_t equal =
+        mismatch(img1->pixel + G(img1, x, y + row), img2->pixel + row * w, w);
+    if (equal < w) {
+      *compared += equal + 1;
+      return 0;
+    }
+    *compared += w;
   }
+
+  return 1;
 }
 
 /// Compare an image to a subimage of a larger image.
@@ -639,29 +1342,17 @@ int ImageMatchSubImage(Image img1, int x, int y, Image img2) { ///
   if (!ImageValidRect(img1, x, y, img2->width, img2->height))
     return 0;
 
-  FOR_COORDINATES(img2, new_x, new_y) {
-    const int img1_value = ImageGetPixel(img1, new_x + x, new_y + y);
-    const int img2_value = ImageGetPixel(img2, new_x, new_y);
-
-    GREYCMP++;
-    if (img1_value != img2_value)
-      return 0;
-  }
+  unsigned long compared = 0;
+  const int match = matchAt(img1, x, y, img2, &compared);
+  COUNT(PIXMEM, 2 * compared); // count two pixel accesses each
+  COUNT(GREYCMP, compared);
 
-  return 1;
+  return match;
 }
 
-/// Locate a subimage inside another image.
-/// Searches for img2 inside img1.
-/// If a match is found, returns 1 and matching position is set in vars (*px,
-/// *py). If no match is found, returns 0 and (*px, *py) are left untouched.
-int ImageLocateSubImage(Image img1, int *px, int *py, Image img2) { ///
-  assert(img1 != NULL);
-  assert(img2 != NULL);
-
-  if (img2->width > img1->width || img2->height > img1->height)
-    return 0;
-
+// Locate img2 inside img1 by matching it at every candidate position.
+// This is an internal function, used by ImageLocateSubImage.
+static int locateNaive(Image img1, int *px, int *py, Image img2) {
   // Since the image needs to fit in order to be a subimage, it doesn't make
   // sense to check the last pixels on the end of a line (or the bottom of an
   // image) that wouldn't have enough space to fit the subimage.
@@ -679,23 +1370,2096 @@ int ImageLocateSubImage(Image img1, int *px, int *py, Image img2) { ///
   return 0;
 }
 
-/// Filtering
+// Bases of the polynomial hashes used by locateHash: HASH_BASE_X for the
+// pixels along a row and HASH_BASE_Y for the row hashes along a column.
+// The arithmetic is modulo 2^64 (unsigned overflow), so different windows may
+// have the same hash, but every hash hit is verified.
+#define HASH_BASE_X 0x100000001B3ULL
+#define HASH_BASE_Y 0x9E3779B97F4A7C15ULL
 
-/// Blur an image by a applying a (2dx+1)x(2dy+1) mean filter.
-/// Each pixel is substituted by the mean of the pixels in the rectangle
-/// [x-dx, x+dx]x[y-dy, y+dy].
-/// The image is changed in-place.
-void ImageBlur(Image img, int dx, int dy) {
-  assert(img != NULL);
-  assert(dx >= 0 && dy >= 0);
+// Returns base^n (modulo 2^64).
+static uint64_t hashPower(uint64_t base, int n) {
+  uint64_t power = 1;
+  while (n-- > 0)
+    power *= base;
+  return power;
+}
 
-  // The blurred pixels will be written to a separate array that will be swapped
-  // at the end because the original pixels values will be needed at all times.
-  const size_t num_pixels = sizeof(uint8) * ImageArea(img);
-  uint8 *blurred_pixels = (uint8 *)malloc(num_pixels);
+// Compute the hashes of all windows of w pixels in row (of width pixels) into
+// hash[0..width-w]. top must be HASH_BASE_X^(w-1).
+// The hash of each window is computed from the previous one, by removing the
+// pixel that left the window and adding the one that entered it.
+static void rowHashes(uint64_t *hash, const uint8 *row, int width, int w,
+                      uint64_t top) {
+  uint64_t h = 0;
+  for (int i = 0; i < w; i++) {
+    h = h * HASH_BASE_X + row[i];
+  }
+  hash[0] = h;
+  for (int x = 1; x + w <= width; x++) {
+    h = (h - row[x - 1] * top) * HASH_BASE_X + row[x + w - 1];
+    hash[x] = h;
+  }
+}
 
-  if (check(blurred_pixels == NULL, "Failed to allocate memory"))
-    return;
+// Minimum number of candidate positions for a search to run in parallel
+#define LOCATE_PARALLEL_MIN (1 << 16)
+
+// State of a search of img2 in img1 by locateHash, shared by the threads
+// doing it.
+// The candidate rows are split in chunks, taken in order by the threads.
+struct locateSearch {
+  Image img1;
+  Image img2;
+  uint64_t target;       // hash of img2
+  uint64_t top_x;        // HASH_BASE_X^(w-1)
+  uint64_t top_y;        // HASH_BASE_Y^(h-1)
+  int rows_per_chunk;    // number of candidate rows in each chunk
+  uint64_t *buffers;     // 3 rows of hashes for each thread
+  atomic_int next_chunk;  // index of the next chunk to search
+  atomic_int next_buffer; // index of the next unused buffer
+  atomic_long best;       // lowest raster index of a match, or LONG_MAX
+  atomic_ulong pixmem;    // pixel accesses, added by each thread at the end
+  atomic_ulong greycmp;   // grey level comparisons, idem
+};
+
+// Lower search->best to index, if it is lower.
+static void lowerBest(struct locateSearch *search, long index) {
+  long best = atomic_load(&search->best);
+  while (index < best &&
+         !atomic_compare_exchange_weak(&search->best, &best, index)) {
+  }
+}
+
+// Search thread of locateHash: searches chunks of candidate rows until there
+// are no more, or the remaining ones are all after a match already found.
+// The hash of each candidate window combines the hashes of its rows, and is
+// updated from the window above it by removing the row that left the window
+// and adding the one that entered it, so each candidate position is filtered
+// in constant time and only the hash hits are matched pixel by pixel.
+static void *locateWorker(void *arg) {
+  struct locateSearch *search = (struct locateSearch *)arg;
+  const Image img1 = search->img1;
+  const Image img2 = search->img2;
+  const int width = img1->width;
+  const int w = img2->width;
+  const int h = img2->height;
+  const int check_width = width - w;
+  const int check_height = img1->height - h;
+  const size_t num_windows = (size_t)check_width + 1;
+
+  // The hashes of the windows in the current candidate row, and the row
+  // hashes of the rows leaving and entering them.
+  uint64_t *window =
+      search->buffers + 3 * num_windows * atomic_fetch_add(&search->next_buffer, 1);
+  uint64_t *leaving = window + num_windows;
+  uint64_t *entering = leaving + num_windows;
+
+  unsigned long pixmem = 0;
+  unsigned long compared = 0;
+
+  for (;;) {
+    const int y_begin =
+        atomic_fetch_add(&search->next_chunk, 1) * search->rows_per_chunk;
+    // Chunks are taken in order, so if this one starts after a match, so do
+    // all the next ones.
+    if (y_begin > check_height ||
+        (long)y_begin * width > atomic_load(&search->best))
+      break;
+    const int y_end = check_height - y_begin < search->rows_per_chunk
+                          ? check_height + 1
+                          : y_begin + search->rows_per_chunk;
+
+    memset(window, 0, num_windows * sizeof(uint64_t));
+    for (int y = y_begin; y < y_begin + h; y++) {
+      rowHashes(entering, img1->pixel + (size_t)y * width, width, w,
+                search->top_x);
+      for (size_t x = 0; x < num_windows; x++) {
+        window[x] = window[x] * HASH_BASE_Y + entering[x];
+      }
+    }
+    pixmem += (unsigned long)h * width;
+
+    for (int y = y_begin; y < y_end; y++) {
+      // Stop at the rows after a match found by any thread.
+      if ((long)y * width > atomic_load(&search->best))
+        break;
+
+      if (y > y_begin) {
+        rowHashes(leaving, img1->pixel + (size_t)(y - 1) * width, width, w,
+                  search->top_x);
+        rowHashes(entering, img1->pixel + (size_t)(y + h - 1) * width, width,
+                  w, search->top_x);
+        for (size_t x = 0; x < num_windows; x++) {
+          window[x] = (window[x] - leaving[x] * search->top_y) * HASH_BASE_Y +
+                      entering[x];
+        }
+        pixmem += 2 * (unsigned long)width;
+      }
+
+      int found = 0;
+      for (int x = 0; x <= check_width && !found; x++) {
+        if (window[x] == search->target &&
+            matchAt(img1, x, y, img2, &compared)) {
+          lowerBest(search, (long)y * width + x);
+          found = 1;
+        }
+      }
+      if (found)
+        break;
+    }
+  }
+
+  atomic_fetch_add(&search->pixmem, pixmem + 2 * compared);
+  atomic_fetch_add(&search->greycmp, compared);
+  return NULL;
+}
+
+// Locate img2 inside img1 with a 2D rolling hash (Rabin-Karp), on as many
+// threads as set by ImageSetThreads, if the search is large enough.
+// Each thread searches chunks of (at least h) candidate rows, and all of them
+// stop at the rows after the first match found, so the match returned is the
+// first in raster order, as in the serial search.
+// This is an internal function, used by ImageLocateSubImage.
+// Returns 1 if found, 0 if not, or -1 if there is not enough memory.
+static int locateHash(Image img1, int *px, int *py, Image img2) {
+  const int w = img2->width;
+  const int h = img2->height;
+  const int num_rows = img1->height - h + 1;
+  const size_t num_windows = (size_t)(img1->width - w) + 1;
+
+  int workers = threadCount();
+  if (num_windows * num_rows < LOCATE_PARALLEL_MIN)
+    workers = 1;
+
+  struct locateSearch search;
+  search.img1 = img1;
+  search.img2 = img2;
+  search.top_x = hashPower(HASH_BASE_X, w - 1);
+  search.top_y = hashPower(HASH_BASE_Y, h - 1);
+
+  // Each chunk must have at least h rows, since the hashes of its first
+  // window are computed from scratch, and there should be a few chunks for
+  // each thread, to balance their work.
+  search.rows_per_chunk = num_rows;
+  if (workers > 1) {
+    const int rows = (num_rows + 4 * workers - 1) / (4 * workers);
+    search.rows_per_chunk = rows > h ? rows : h;
+    const int num_chunks =
+        (num_rows + search.rows_per_chunk - 1) / search.rows_per_chunk;
+    if (workers > num_chunks)
+      workers = num_chunks;
+  }
+
+  search.buffers =
+      (uint64_t *)malloc(workers * 3 * num_windows * sizeof(uint64_t));
+  if (search.buffers == NULL)
+    return -1;
+
+  uint64_t *row = search.buffers;
+  search.target = 0;
+  for (int y = 0; y < h; y++) {
+    rowHashes(row, img2->pixel + y * w, w, w, search.top_x);
+    search.target = search.target * HASH_BASE_Y + row[0];
+  }
+  COUNT(PIXMEM, ImageArea(img2)); // count pixel memory accesses
+
+  atomic_init(&search.next_chunk, 0);
+  atomic_init(&search.next_buffer, 0);
+  atomic_init(&search.best, LONG_MAX);
+  atomic_init(&search.pixmem, 0);
+  atomic_init(&search.greycmp, 0);
+
+  runWorkers(locateWorker, &search, workers);
+
+  free(search.buffers);
+  COUNT(PIXMEM, atomic_load(&search.pixmem));
+  COUNT(GREYCMP, atomic_load(&search.greycmp));
+
+  const long best = atomic_load(&search.best);
+  if (best == LONG_MAX)
+    return 0;
+  *px = (int)(best % img1->width);
+  *py = (int)(best / img1->width);
+  return 1;
+}
+
+// Anchor pixel of a subimage: a pixel of it with the gray level that is the
+// least frequent in the image where it is searched.
+struct anchor {
+  int x;              // position of the anchor in the subimage
+  int y;
+  uint8 level;        // level of the anchor
+  unsigned long hits; // number of pixels with that level in the image
+};
+
+// Average cost of matching img2 at a candidate position where the anchor
+// matches (at most), and maximum average cost for each candidate position for
+// locateAnchor to be used instead of locateHash (which costs about as much as
+// reading a few pixels for each candidate), in pixels compared.
+#define ANCHOR_MATCH_COST 64
+#define ANCHOR_MAX_COST 2
+
+// Find the anchor of img2 for searching it in img1.
+static void findAnchor(struct anchor *anchor, Image img1, Image img2) {
+  // The histogram of img1 is built in 4 parts, so that runs of the same level
+  // do not make each increment wait for the previous one.
+  unsigned long hist[4][256] = {{0}};
+  const size_t num_pixels = ImageArea(img1);
+  size_t i = 0;
+  for (; i + 4 <= num_pixels; i += 4) {
+    hist[0][img1->pixel[i]]++;
+    hist[1][img1->pixel[i + 1]]++;
+    hist[2][img1->pixel[i + 2]]++;
+    hist[3][img1->pixel[i + 3]]++;
+  }
+  for (; i < num_pixels; i++) {
+    hist[0][img1->pixel[i]]++;
+  }
+  for (int level = 0; level < 256; level++) {
+    hist[0][level] += hist[1][level] + hist[2][level] + hist[3][level];
+  }
+  COUNT(PIXMEM, num_pixels); // count pixel memory accesses
+
+  // First position of each level in img2 (or -1)
+  int first[256];
+  for (int level = 0; level < 256; level++) {
+    first[level] = -1;
+  }
+  for (int i = ImageArea(img2) - 1; i >= 0; i--) {
+    first[img2->pixel[i]] = i;
+  }
+  COUNT(PIXMEM, ImageArea(img2)); // count pixel memory accesses
+
+  anchor->hits = ULONG_MAX;
+  for (int level = 0; level < 256; level++) {
+    if (first[level] >= 0 && hist[0][level] < anchor->hits) {
+      anchor->x = first[level] % img2->width;
+      anchor->y = first[level] / img2->width;
+      anchor->level = (uint8)level;
+      anchor->hits = hist[0][level];
+    }
+  }
+}
+
+// Locate img2 inside img1 by scanning each candidate row for the anchor
+// level, with memchr (which is vectorized), and matching img2 only where the
+// anchor matches.
+// This is an internal function, used by ImageLocateSubImage.
+static int locateAnchor(Image img1, int *px, int *py, Image img2,
+                        const struct anchor *anchor) {
+  const int check_width = img1->width - img2->width;
+  const int check_height = img1->height - img2->height;
+  unsigned long compared = 0;
+  int found = 0;
+
+  for (int y = 0; y <= check_height && !found; y++) {
+    // The pixels where the anchor would be for each candidate of row y
+    const uint8 *row = img1->pixel + G(img1, anchor->x, y + anchor->y);
+    const uint8 *end = row + check_width + 1;
+    for (const uint8 *p = row;
+         (p = memchr(p, anchor->level, end - p)) != NULL; p++) {
+      const int x = p - row;
+      if (matchAt(img1, x, y, img2, &compared)) {
+        *px = x;
+        *py = y;
+        found = 1;
+        break;
+      }
+    }
+    // count pixel memory accesses
+    COUNT(PIXMEM, found ? *px + 1 : check_width + 1);
+  }
+  COUNT(PIXMEM, 2 * compared); // count two pixel accesses each
+  COUNT(GREYCMP, compared);
+
+  return found;
+}
+
+/// Locate a subimage inside another image.
+/// Searches for img2 inside img1.
+/// If a match is found, returns 1 and matching position is set in vars (*px,
+/// *py). If no match is found, returns 0 and (*px, *py) are left untouched.
+int ImageLocateSubImage(Image img1, int *px, int *py, Image img2) { ///
+  assert(img1 != NULL);
+  assert(img2 != NULL);
+
+  if (img2->width > img1->width || img2->height > img1->height)
+    return 0;
+
+  if (ImageArea(img2) == 0)
+    return locateNaive(img1, px, py, img2);
+
+  // Matching at every position takes O(W*H*w*h) time in the worst case
+  // (e.g., a black image and subimage with a single white pixel), so the
+  // candidate positions are filtered first: by the anchor pixel, if it is
+  // rare enough in img1, or else by hash.
+  // If that fails for lack of memory, fall back to matching them all.
+  struct anchor anchor;
+  findAnchor(&anchor, img1, img2);
+  const double candidates = (double)(img1->width - img2->width + 1) *
+                            (img1->height - img2->height + 1);
+  const int area = ImageArea(img2);
+  const int match_cost = area < ANCHOR_MATCH_COST ? area : ANCHOR_MATCH_COST;
+  if ((double)anchor.hits * match_cost < candidates * ANCHOR_MAX_COST)
+    return locateAnchor(img1, px, py, img2, &anchor);
+
+  const int found = locateHash(img1, px, py, img2);
+  if (found >= 0)
+    return found;
+  return locateNaive(img1, px, py, img2);
+}
+
+/// Integral images
+
+// Minimum number of pixels for an integral image to be computed in parallel
+#define INTEGRAL_PARALLEL_MIN (1 << 16)
+
+// Sum of the entries of an image in rectangle (x, y, w, h), given its
+// integral image table (with rows stride entries apart).
+static inline uint64_t rectSum(const uint64_t *table, int stride, int x, int y,
+                               int w, int h) {
+  const uint64_t *top = table + (size_t)y * stride + x;
+  const uint64_t *bottom = top + (size_t)h * stride;
+  return bottom[w] - bottom[0] - top[w] + top[0];
+}
+
+// State of the computation of an integral image by ImageIntegralCreate,
+// shared by the threads doing it.
+// The rows are split in bands, and it is done in two phases: first each band
+// is summed as if it were the top of the image, and then, once the last row
+// of each band is completed (in order, by the calling thread), the last row
+// of the band above is added to the other rows of each band.
+struct integralJob {
+  Image img;
+  ImageIntegral ii;
+  int rows_per_band;    // number of rows in each band
+  int phase;            // 1 or 2
+  atomic_int next_band; // index of the next band to do in the phase
+};
+
+// Sum rows [y_begin, y_end[ of the image into the integral image, as if
+// y_begin were the top row.
+static void integralBand(Image img, ImageIntegral ii, int y_begin,
+                         int y_end) {
+  const int stride = ii->stride;
+  for (int y = y_begin; y < y_end; y++) {
+    const uint8 *row = img->pixel + (size_t)y * img->width;
+    const size_t i = (size_t)(y + 1) * stride + 1;
+    // The sums of the row above (none for the first row of the band)
+    const size_t above = y == y_begin ? 0 : i - stride;
+    uint64_t row_sum = 0;
+    uint64_t row_sq = 0;
+    for (int x = 0; x < img->width; x++) {
+      row_sum += row[x];
+      ii->sum[i + x] = (above ? ii->sum[above + x] : 0) + row_sum;
+    }
+    if (ii->sq != NULL) {
+      for (int x = 0; x < img->width; x++) {
+        row_sq += (uint64_t)row[x] * row[x];
+        ii->sq[i + x] = (above ? ii->sq[above + x] : 0) + row_sq;
+      }
+    }
+  }
+}
+
+// Add the sums of the rows above image row offset_y (its row in the integral
+// image) to rows [y_begin, y_end[ of the integral image (as numbered in the
+// image).
+static void integralOffset(ImageIntegral ii, int offset_y, int y_begin,
+                           int y_end) {
+  const int stride = ii->stride;
+  const size_t offset = (size_t)offset_y * stride + 1;
+  for (int y = y_begin; y < y_end; y++) {
+    const size_t i = (size_t)(y + 1) * stride + 1;
+    for (int x = 0; x < ii->width; x++) {
+      ii->sum[i + x] += ii->sum[offset + x];
+    }
+    if (ii->sq != NULL) {
+      for (int x = 0; x < ii->width; x++) {
+        ii->sq[i + x] += ii->sq[offset + x];
+      }
+    }
+  }
+}
+
+// Do the bands of the current phase until there are none left.
+static void *integralWorker(void *arg) {
+  struct integralJob *job = (struct integralJob *)arg;
+  const int height = job->img->height;
+  for (;;) {
+    const int y_begin =
+        atomic_fetch_add(&job->next_band, 1) * job->rows_per_band;
+    if (y_begin >= height)
+      break;
+    const int y_end = height - y_begin < job->rows_per_band
+                          ? height
+                          : y_begin + job->rows_per_band;
+    if (job->phase == 1) {
+      integralBand(job->img, job->ii, y_begin, y_end);
+    } else if (y_begin > 0) {
+      // The last row was completed by ImageIntegralCreate
+      integralOffset(job->ii, y_begin, y_begin, y_end - 1);
+    }
+  }
+  return NULL;
+}
+
+/// Create the integral image (summed-area table) of img, from which the sum
+/// of the levels in any rectangle is computed in constant time, and also the
+/// sum of their squares, if squares is nonzero.
+/// The sums are 64-bit, and large images are summed by as many threads as
+/// set by ImageSetThreads.
+/// Ensures: img is not modified (and may be destroyed afterwards).
+///
+/// On success, a new integral image is returned.
+/// (The caller is responsible for destroying the returned integral image!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+ImageIntegral ImageIntegralCreate(Image img, int squares) { ///
+  assert(img != NULL);
+
+  const int stride = img->width + 1;
+  const size_t size = (size_t)stride * (img->height + 1);
+  ImageIntegral ii = (ImageIntegral)malloc(sizeof(struct imageIntegral));
+  if (!check(ii != NULL, "Failed to allocate integral image"))
+    return NULL;
+  ii->width = img->width;
+  ii->height = img->height;
+  ii->stride = stride;
+  // The top row and left column are zero, for the empty rectangles
+  ii->sum = (uint64_t *)calloc((squares ? 2 : 1) * size, sizeof(uint64_t));
+  if (!check(ii->sum != NULL, "Failed to allocate integral image")) {
+    free(ii);
+    return NULL;
+  }
+  ii->sq = squares ? ii->sum + size : NULL;
+
+  int workers = threadCount();
+  if (ImageArea(img) < INTEGRAL_PARALLEL_MIN)
+    workers = 1;
+
+  struct integralJob job;
+  job.img = img;
+  job.ii = ii;
+  job.rows_per_band = img->height;
+  if (workers > 1) {
+    job.rows_per_band = (img->height + workers - 1) / workers;
+    const int num_bands =
+        (img->height + job.rows_per_band - 1) / job.rows_per_band;
+    if (workers > num_bands)
+      workers = num_bands;
+  }
+
+  job.phase = 1;
+  atomic_init(&job.next_band, 0);
+  runWorkers(integralWorker, &job, workers);
+  if (job.rows_per_band < img->height) {
+    // Complete the last row of each band, in order
+    for (int y_begin = job.rows_per_band; y_begin < img->height;
+         y_begin += job.rows_per_band) {
+      const int y_last = (img->height - y_begin < job.rows_per_band
+                              ? img->height
+                              : y_begin + job.rows_per_band) -
+                         1;
+      integralOffset(ii, y_begin, y_last, y_last + 1);
+    }
+    job.phase = 2;
+    atomic_init(&job.next_band, 0);
+    runWorkers(integralWorker, &job, workers);
+  }
+  COUNT(PIXMEM, ImageArea(img)); // count pixel memory accesses
+
+  return ii;
+}
+
+/// Destroy the integral image pointed to by (*iip).
+/// If (*iip)==NULL, no operation is performed.
+/// Ensures: (*iip)==NULL.
+void ImageIntegralDestroy(ImageIntegral *iip) { ///
+  assert(iip != NULL);
+  if (*iip == NULL)
+    return;
+  free((*iip)->sum);
+  free(*iip);
+  *iip = NULL;
+}
+
+// Split the range [begin, begin + len[ of positions along an axis of n
+// pixels, clamped to [0, n - 1], into: the range [*inner_begin, *inner_end[
+// of positions inside, the number *before of positions before 0 and the
+// number *after of positions after n - 1.
+static void clampRange(int begin, int len, int n, int *inner_begin,
+                       int *inner_end, int *before, int *after) {
+  const long end = (long)begin + len;
+  *before = begin < 0 ? (int)((end < 0 ? end : 0) - begin) : 0;
+  *after = end > n ? (int)(end - (begin > n ? begin : n)) : 0;
+  *inner_begin = begin < 0 ? 0 : begin < n ? begin : n;
+  *inner_end = end < n ? (int)end : n;
+  if (*inner_end < *inner_begin)
+    *inner_end = *inner_begin;
+}
+
+// Sum of the entries of an image in rectangle (x, y, w, h), where the entries
+// outside the image are those of the nearest border pixel, given its integral
+// image table.
+// The clamped rectangle is the sum of up to 9 rectangles inside the image:
+// the inner part, and the rows and columns of the border repeated for the
+// parts outside.
+static uint64_t clampedRectSum(ImageIntegral ii, const uint64_t *table, int x,
+                               int y, int w, int h) {
+  if (x >= 0 && y >= 0 && w <= ii->width - x && h <= ii->height - y)
+    return rectSum(table, ii->stride, x, y, w, h);
+
+  int col_begin[3], col_end[3], col_weight[3];
+  int row_begin[3], row_end[3], row_weight[3];
+  clampRange(x, w, ii->width, &col_begin[0], &col_end[0], &col_weight[1],
+             &col_weight[2]);
+  clampRange(y, h, ii->height, &row_begin[0], &row_end[0], &row_weight[1],
+             &row_weight[2]);
+  col_weight[0] = 1;
+  col_begin[1] = 0;
+  col_end[1] = 1;
+  col_begin[2] = ii->width - 1;
+  col_end[2] = ii->width;
+  row_weight[0] = 1;
+  row_begin[1] = 0;
+  row_end[1] = 1;
+  row_begin[2] = ii->height - 1;
+  row_end[2] = ii->height;
+
+  uint64_t sum = 0;
+  for (int i = 0; i < 3; i++) {
+    for (int j = 0; j < 3; j++) {
+      if (row_weight[i] == 0 || col_weight[j] == 0)
+        continue;
+      sum += (uint64_t)row_weight[i] * col_weight[j] *
+             rectSum(table, ii->stride, col_begin[j], row_begin[i],
+                     col_end[j] - col_begin[j], row_end[i] - row_begin[i]);
+    }
+  }
+  return sum;
+}
+
+/// Sum of the levels in rectangle (x, y, w, h) of the image of ii.
+/// The rectangle may extend beyond the image, whose pixels outside are those
+/// of the nearest border pixel (as in ImageBlur).
+/// Requires: w, h >= 0, and the image must not be empty, if w*h > 0.
+uint64_t ImageRectSum(ImageIntegral ii, int x, int y, int w, int h) { ///
+  assert(ii != NULL);
+  assert(w >= 0 && h >= 0);
+  assert((uint64_t)w * h == 0 || (uint64_t)ii->width * ii->height > 0);
+  return clampedRectSum(ii, ii->sum, x, y, w, h);
+}
+
+/// Sum of the squares of the levels in rectangle (x, y, w, h) of the image of
+/// ii, as ImageRectSum.
+/// Requires: ii must have been created with the squares.
+uint64_t ImageRectSumSq(ImageIntegral ii, int x, int y, int w, int h) { ///
+  assert(ii != NULL);
+  assert(ii->sq != NULL);
+  assert(w >= 0 && h >= 0);
+  assert((uint64_t)w * h == 0 || (uint64_t)ii->width * ii->height > 0);
+  return clampedRectSum(ii, ii->sq, x, y, w, h);
+}
+
+/// Mean of the levels in rectangle (x, y, w, h) of the image of ii, as
+/// ImageRectSum.
+/// Requires: w, h > 0.
+double ImageRectMean(ImageIntegral ii, int x, int y, int w, int h) { ///
+  assert(w > 0 && h > 0);
+  return (double)ImageRectSum(ii, x, y, w, h) / ((double)w * h);
+}
+
+/// Approximate matching
+
+// Number of 16 pixel steps after which the 32-bit SIMD accumulators of
+// rowSSD and rowDot are added to a 64-bit sum, before they may overflow.
+#define ROW_ACC_STEPS 4096
+
+// Sum of absolute differences of the n pixels at a and b.
+static inline uint64_t rowSAD(const uint8 *a, const uint8 *b, size_t n) {
+  uint64_t sum = 0;
+  size_t i = 0;
+#ifdef __SSE2__
+  __m128i acc = _mm_setzero_si128();
+  for (; i + 16 <= n; i += 16) {
+    const __m128i va = _mm_loadu_si128((const __m128i *)(a + i));
+    const __m128i vb = _mm_loadu_si128((const __m128i *)(b + i));
+    acc = _mm_add_epi64(acc, _mm_sad_epu8(va, vb));
+  }
+  uint64_t lanes[2];
+  _mm_storeu_si128((__m128i *)lanes, acc);
+  sum = lanes[0] + lanes[1];
+#endif
+  for (; i < n; i++) {
+    sum += a[i] > b[i] ? a[i] - b[i] : b[i] - a[i];
+  }
+  return sum;
+}
+
+// Sum of squared differences of the n pixels at a and b.
+static inline uint64_t rowSSD(const uint8 *a, const uint8 *b, size_t n) {
+  uint64_t sum = 0;
+  size_t i = 0;
+#ifdef __SSE2__
+  const __m128i zero = _mm_setzero_si128();
+  while (i + 16 <= n) {
+    __m128i acc = _mm_setzero_si128();
+    for (int step = 0; step < ROW_ACC_STEPS && i + 16 <= n; step++, i += 16) {
+      const __m128i va = _mm_loadu_si128((const __m128i *)(a + i));
+      const __m128i vb = _mm_loadu_si128((const __m128i *)(b + i));
+      const __m128i lo = _mm_sub_epi16(_mm_unpacklo_epi8(va, zero),
+                                       _mm_unpacklo_epi8(vb, zero));
+      const __m128i hi = _mm_sub_epi16(_mm_unpackhi_epi8(va, zero),
+                                       _mm_unpackhi_epi8(vb, zero));
+      acc = _mm_add_epi32(acc, _mm_madd_epi16(lo, lo));
+      acc = _mm_add_epi32(acc, _mm_madd_epi16(hi, hi));
+    }
+    uint32_t lanes[4];
+    _mm_storeu_si128((__m128i *)lanes, acc);
+    sum += (uint64_t)lanes[0] + lanes[1] + lanes[2] + lanes[3];
+  }
+#endif
+  for (; i < n; i++) {
+    const int d = a[i] - b[i];
+    sum += (uint64_t)(d * d);
+  }
+  return sum;
+}
+
+// Sum of the products of the n pixels at a and b.
+static inline uint64_t rowDot(const uint8 *a, const uint8 *b, size_t n) {
+  uint64_t sum = 0;
+  size_t i = 0;
+#ifdef __SSE2__
+  const __m128i zero = _mm_setzero_si128();
+  while (i + 16 <= n) {
+    __m128i acc = _mm_setzero_si128();
+    for (int step = 0; step < ROW_ACC_STEPS && i + 16 <= n; step++, i += 16) {
+      const __m128i va = _mm_loadu_si128((const __m128i *)(a + i));
+      const __m128i vb = _mm_loadu_si128((const __m128i *)(b + i));
+      acc = _mm_add_epi32(acc, _mm_madd_epi16(_mm_unpacklo_epi8(va, zero),
+                                              _mm_unpacklo_epi8(vb, zero)));
+      acc = _mm_add_epi32(acc, _mm_madd_epi16(_mm_unpackhi_epi8(va, zero),
+                                              _mm_unpackhi_epi8(vb, zero)));
+    }
+    uint32_t lanes[4];
+    _mm_storeu_si128((__m128i *)lanes, acc);
+    sum += (uint64_t)lanes[0] + lanes[1] + lanes[2] + lanes[3];
+  }
+#endif
+  for (; i < n; i++) {
+    sum += (uint64_t)a[i] * b[i];
+  }
+  return sum;
+}
+
+// Best matches found so far by ImageLocateAll: a heap of at most max
+// matches, with the worst one at the top (matches[0]).
+struct matchHeap {
+  ImageMatch *matches;
+  int count;
+  int max;
+  int higher_better; // 1 for scores where higher is better (NCC)
+};
+
+// Is match a worse than match b?
+// Of two matches with the same score, the last in raster order is worse.
+static int matchWorse(const struct matchHeap *heap, const ImageMatch *a,
+                      const ImageMatch *b) {
+  if (a->score != b->score)
+    return heap->higher_better ? a->score < b->score : a->score > b->score;
+  return a->y != b->y ? a->y > b->y : a->x > b->x;
+}
+
+// Restore the heap order from index i down, in the first count matches.
+static void matchSiftDown(struct matchHeap *heap, int i, int count) {
+  ImageMatch *m = heap->matches;
+  for (;;) {
+    int worst = i;
+    const int left = 2 * i + 1;
+    const int right = left + 1;
+    if (left < count && matchWorse(heap, &m[left], &m[worst]))
+      worst = left;
+    if (right < count && matchWorse(heap, &m[right], &m[worst]))
+      worst = right;
+    if (worst == i)
+      return;
+    const ImageMatch t = m[i];
+    m[i] = m[worst];
+    m[worst] = t;
+    i = worst;
+  }
+}
+
+// Add a match to the heap, if it is not full or the match is better than the
+// worst one (which is then dropped).
+static void matchAdd(struct matchHeap *heap, int x, int y, double score) {
+  const ImageMatch match = {x, y, score, 0};
+  ImageMatch *m = heap->matches;
+  if (heap->count < heap->max) {
+    int i = heap->count++;
+    while (i > 0 && matchWorse(heap, &match, &m[(i - 1) / 2])) {
+      m[i] = m[(i - 1) / 2];
+      i = (i - 1) / 2;
+    }
+    m[i] = match;
+  } else if (heap->max > 0 && matchWorse(heap, &m[0], &match)) {
+    m[0] = match;
+    matchSiftDown(heap, 0, heap->count);
+  }
+}
+
+// Sort the matches in the heap, best first.
+static void matchSort(struct matchHeap *heap) {
+  for (int i = heap->count - 1; i > 0; i--) {
+    const ImageMatch t = heap->matches[0];
+    heap->matches[0] = heap->matches[i];
+    heap->matches[i] = t;
+    matchSiftDown(heap, 0, i);
+  }
+}
+
+// SAD or SSD of img2 at position (x, y) of img1, computed a row at a time
+// until it exceeds limit (then a value greater than limit is returned).
+// Adds the number of pixels compared to (*compared).
+static double distanceAt(Image img1, int x, int y, Image img2,
+                         ImageScore score, double limit,
+                         unsigned long *compared) {
+  const size_t w = img2->width;
+  uint64_t sum = 0;
+  for (int row = 0; row < img2->height && sum <= limit; row++) {
+    const uint8 *a = img1->pixel + G(img1, x, y + row);
+    const uint8 *b = img2->pixel + row * w;
+    sum += score == IMAGE_SAD ? rowSAD(a, b, w) : rowSSD(a, b, w);
+    *compared += w;
+  }
+  return (double)sum;
+}
+
+// FFT correlation
+//
+// The products of img2 with all the windows of img1 are the cross-correlation
+// of the two images, which is computed with the fast Fourier transform (FFT)
+// in O(P*Q*log(P*Q)) time, for a P by Q transform (the size of img1 rounded up
+// to powers of 2), instead of O(W*H*w*h) time.
+
+// Ratio of the cost of the FFT correlation, per P*Q*log2(P*Q), to the cost of
+// comparing a pixel, above which ImageLocateAll uses the FFT.
+// (The default was measured with the benchmark.)
+static double fft_crossover = 30.0;
+
+/// Set when ImageLocateAll uses the FFT correlation.
+/// For SSD and NCC scores, the products of img2 with all the windows of img1
+/// are computed by FFT when the number of pixels compared otherwise (number
+/// of positions times area of img2) is more than crossover * P*Q*log2(P*Q),
+/// where P by Q is the size of img1 rounded up to powers of 2.
+/// So 0 always uses the FFT, and INFINITY never does.
+void ImageSetFFTCrossover(double crossover) { ///
+  assert(crossover >= 0.0);
+  fft_crossover = crossover;
+}
+
+// Smallest power of 2 not less than n.
+static size_t powerOf2(size_t n) {
+  size_t p = 1;
+  while (p < n)
+    p <<= 1;
+  return p;
+}
+
+// In-place FFT (or inverse FFT, without the 1/n scaling) of the n values at
+// a, where n is a power of 2 (iterative radix-2 Cooley-Tukey).
+// twiddle[k] must be exp(-2*pi*i*k/N), for k < N/2, where N is a multiple
+// of n.
+static void fft(double complex *a, size_t n, const double complex *twiddle,
+                size_t N, int inverse) {
+  // Bit reversal permutation
+  for (size_t i = 1, j = 0; i < n; i++) {
+    size_t bit = n >> 1;
+    for (; j & bit; bit >>= 1)
+      j ^= bit;
+    j ^= bit;
+    if (i < j) {
+      const double complex t = a[i];
+      a[i] = a[j];
+      a[j] = t;
+    }
+  }
+
+  for (size_t len = 2; len <= n; len <<= 1) {
+    const size_t half = len / 2;
+    const size_t step = N / len;
+    for (size_t i = 0; i < n; i += len) {
+      for (size_t k = 0; k < half; k++) {
+        const double complex w =
+            inverse ? conj(twiddle[k * step]) : twiddle[k * step];
+        const double complex u = a[i + k];
+        const double complex v = a[i + k + half] * w;
+        a[i + k] = u + v;
+        a[i + k + half] = u - v;
+      }
+    }
+  }
+}
+
+// In-place 2D FFT (or inverse FFT, without scaling) of the P by Q values at a
+// (stored by rows): the FFT of each row, then of each column, copied to
+// column (of Q values) so that its values are contiguous.
+static void fft2D(double complex *a, size_t P, size_t Q,
+                  double complex *column, const double complex *twiddle,
+                  size_t N, int inverse) {
+  for (size_t y = 0; y < Q; y++) {
+    fft(a + y * P, P, twiddle, N, inverse);
+  }
+  for (size_t x = 0; x < P; x++) {
+    for (size_t y = 0; y < Q; y++) {
+      column[y] = a[y * P + x];
+    }
+    fft(column, Q, twiddle, N, inverse);
+    for (size_t y = 0; y < Q; y++) {
+      a[y * P + x] = column[y];
+    }
+  }
+}
+
+// Compute the products of img2 with all the windows of img1 by FFT:
+//   dot[y * (W-w+1) + x] = sum of img1(x+i, y+j) * img2(i, j)
+// Returns 1 on success, or 0 if there is not enough memory.
+// This is an internal function, used by ImageLocateAll.
+static int correlateFFT(Image img1, Image img2, double *dot) {
+  const size_t P = powerOf2(img1->width);
+  const size_t Q = powerOf2(img1->height);
+  const size_t N = P > Q ? P : Q;
+  double complex *z =
+      (double complex *)malloc((P * Q + Q + N / 2) * sizeof(double complex));
+  if (z == NULL)
+    return 0;
+  double complex *column = z + P * Q;
+  double complex *twiddle = column + Q;
+  for (size_t k = 0; k < N / 2; k++) {
+    twiddle[k] = cexp(-2.0 * M_PI * I * (double)k / (double)N);
+  }
+
+  // Both (real) images are transformed at once, as z = img1 + i*img2 (padded
+  // with zeros), and their transforms are then separated using their
+  // symmetry: F1[k] = (Z[k] + conj(Z[-k])) / 2, F2[k] = (Z[k] - conj(Z[-k])) / 2i
+  for (size_t y = 0; y < Q; y++) {
+    for (size_t x = 0; x < P; x++) {
+      double complex v = 0.0;
+      if (x < (size_t)img1->width && y < (size_t)img1->height)
+        v = img1->pixel[y * img1->width + x];
+      if (x < (size_t)img2->width && y < (size_t)img2->height)
+        v += I * img2->pixel[y * img2->width + x];
+      z[y * P + x] = v;
+    }
+  }
+  COUNT(PIXMEM, ImageArea(img1) + ImageArea(img2)); // count pixel accesses
+  fft2D(z, P, Q, column, twiddle, N, 0);
+
+  // The transform of the correlation is F1[k] * conj(F2[k]).
+  // Each k is computed together with -k, which uses the same values.
+  for (size_t ky = 0; ky < Q; ky++) {
+    for (size_t kx = 0; kx < P; kx++) {
+      const size_t k = ky * P + kx;
+      const size_t mk = ((Q - ky) % Q) * P + (P - kx) % P;
+      if (mk < k)
+        continue;
+      const double complex a = z[k];
+      const double complex b = conj(z[mk]);
+      const double complex f1 = (a + b) / 2.0;
+      const double complex f2 = (a - b) / (2.0 * I);
+      // At -k, F1 and F2 are the conjugates of those at k.
+      z[k] = f1 * conj(f2);
+      z[mk] = conj(z[k]);
+    }
+  }
+  fft2D(z, P, Q, column, twiddle, N, 1);
+
+  // The products are integers, so rounding removes the FFT rounding errors.
+  const int num_x = img1->width - img2->width + 1;
+  const int num_y = img1->height - img2->height + 1;
+  for (int y = 0; y < num_y; y++) {
+    for (int x = 0; x < num_x; x++) {
+      dot[(size_t)y * num_x + x] =
+          nearbyint(creal(z[(size_t)y * P + x]) / (double)(P * Q));
+    }
+  }
+
+  free(z);
+  return 1;
+}
+
+// NCC score from the product of the window and the subimage, the sum and
+// sum of squares of the window, the sum and variance of the subimage, and
+// the number of pixels of each.
+static inline double nccScore(double dot, double sum1, double sq1, double sum2,
+                              double var2, double n) {
+  const double var1 = sq1 - sum1 * sum1 / n;
+  if (var1 <= 0.0 || var2 <= 0.0)
+    return 0.0;
+  return (dot - sum1 * sum2 / n) / sqrt(var1 * var2);
+}
+
+/// Locate all approximate matches of a subimage.
+/// Searches for img2 inside img1, and finds the positions where its score is
+/// at least as good as threshold (<= for SAD and SSD, >= for NCC).
+/// The best max of them are stored in matches[0..max-1], best first (and in
+/// raster order, for equal scores).
+/// On success, returns the number of matches found (which may be more than
+/// max, then only the best max are stored, so a caller may search again with
+/// room for all of them).
+/// On failure, returns -1 and errno/errCause are set accordingly.
+int ImageLocateAll(Image img1, Image img2, ImageScore score, double threshold,
+                   ImageMatch *matches, int max) { ///
+  assert(img1 != NULL);
+  assert(img2 != NULL);
+  assert(max >= 0);
+  assert(matches != NULL || max == 0);
+
+  struct matchHeap heap = {matches, 0, max, score == IMAGE_NCC};
+  if (img2->width > img1->width || img2->height > img1->height)
+    return 0;
+
+  // The sums of the levels (and their squares) in each window of img1 come
+  // from its integral images, in constant time.
+  // For SAD and SSD, they give lower bounds of the score, and the windows
+  // that cannot beat the threshold are skipped without comparing any pixels
+  // (the others are all compared, to count every match, even when there are
+  // already max better ones):
+  //   SAD >= |sum1 - sum2|
+  //   SSD >= (sqrt(sq1) - sqrt(sq2))^2        (Cauchy-Schwarz)
+  // For NCC, they give the means and variances, and only the sum of the
+  // products of the pixels is computed for each window:
+  //   NCC = (dot - sum1 * sum2 / n) / sqrt(var1 * var2)
+  //   var = sq - sum^2 / n
+  ImageIntegral in = ImageIntegralCreate(img1, 1);
+  if (in == NULL)
+    return -1;
+
+  const int w = img2->width;
+  const int h = img2->height;
+  const double n = (double)w * h;
+  uint64_t sum2 = 0;
+  uint64_t sq2 = 0;
+  for (int i = 0; i < ImageArea(img2); i++) {
+    sum2 += img2->pixel[i];
+    sq2 += (uint64_t)img2->pixel[i] * img2->pixel[i];
+  }
+  COUNT(PIXMEM, ImageArea(img2)); // count pixel memory accesses
+  const double norm2 = sqrt((double)sq2);
+  const double var2 = (double)sq2 - (double)sum2 * sum2 / n;
+
+  // For SSD and NCC, if the subimage is large, the products with all the
+  // windows are computed first by FFT, and then each score takes constant
+  // time:
+  //   SSD = sq1 - 2 * dot + sq2
+  // (If there is not enough memory for the FFT, the pixels are compared.)
+  const int num_x = img1->width - w + 1;
+  const int num_y = img1->height - h + 1;
+  double *dots = NULL;
+  if (score != IMAGE_SAD) {
+    const double P = powerOf2(img1->width);
+    const double Q = powerOf2(img1->height);
+    const double spatial_cost = (double)num_x * num_y * n;
+    const double fft_cost = fft_crossover * P * Q * log2(P * Q);
+    if (spatial_cost > fft_cost) {
+      dots = (double *)malloc((size_t)num_x * num_y * sizeof(double));
+      if (dots != NULL && !correlateFFT(img1, img2, dots)) {
+        free(dots);
+        dots = NULL;
+      }
+    }
+  }
+
+  unsigned long compared = 0;
+  int found = 0;
+  for (int y = 0; y < num_y; y++) {
+    for (int x = 0; x < num_x; x++) {
+      const double sum1 = rectSum(in->sum, in->stride, x, y, w, h);
+      const double sq1 = rectSum(in->sq, in->stride, x, y, w, h);
+
+      if (dots != NULL) {
+        const double dot = dots[(size_t)y * num_x + x];
+        if (score == IMAGE_NCC) {
+          const double ncc = nccScore(dot, sum1, sq1, sum2, var2, n);
+          if (ncc >= threshold) {
+            matchAdd(&heap, x, y, ncc);
+            found++;
+          }
+        } else {
+          const double ssd = sq1 - 2.0 * dot + (double)sq2;
+          if (ssd <= threshold) {
+            matchAdd(&heap, x, y, ssd);
+            found++;
+          }
+        }
+        continue;
+      }
+
+      if (score == IMAGE_NCC) {
+        double dot = 0.0;
+        if (sq1 - sum1 * sum1 / n > 0.0 && var2 > 0.0) {
+          uint64_t products = 0;
+          for (int row = 0; row < h; row++) {
+            products += rowDot(img1->pixel + G(img1, x, y + row),
+                               img2->pixel + (size_t)row * w, w);
+          }
+          compared += (unsigned long)w * h;
+          dot = (double)products;
+        }
+        const double ncc = nccScore(dot, sum1, sq1, sum2, var2, n);
+        if (ncc >= threshold) {
+          matchAdd(&heap, x, y, ncc);
+          found++;
+        }
+        continue;
+      }
+
+      // (the SSD bound is rounded, and may be slightly above the exact bound,
+      // so it only prunes when above the threshold by more than its rounding
+      // error, relative to the sums of squares, or an exact match at the
+      // threshold could be lost)
+      const double bound = score == IMAGE_SAD
+                               ? fabs(sum1 - (double)sum2)
+                               : (sqrt(sq1) - norm2) * (sqrt(sq1) - norm2);
+      const double slack =
+          score == IMAGE_SAD ? 0.0 : 1e-12 * (sq1 + (double)sq2);
+      if (bound > threshold + slack)
+        continue;
+
+      const double distance = distanceAt(img1, x, y, img2, score, threshold,
+                                         &compared);
+      if (distance <= threshold) {
+        matchAdd(&heap, x, y, distance);
+        found++;
+      }
+    }
+  }
+  COUNT(PIXMEM, 2 * compared); // count two pixel accesses each
+  COUNT(GREYCMP, compared);
+
+  free(dots);
+  ImageIntegralDestroy(&in);
+  matchSort(&heap);
+  return found;
+}
+
+/// Multiple subimages
+
+// Aho-Corasick automaton for a set of strings (patterns) of symbols in
+// [0, alphabet), built as a DFA: next[state * alphabet + symbol] is the state
+// after reading symbol in state. State 0 is the root (the empty string), and
+// each state represents the longest suffix of the text read so far that is a
+// prefix of some pattern.
+// This is an internal structure, used by ImageLocateMany.
+struct automaton {
+  int alphabet;
+  int num_states;
+  int *next;
+  int *depth;   // length of the prefix represented by each state
+  int *pattern; // a pattern that ends at each state, or -1
+  int *dict;    // nearest state in the failure chain that ends a pattern, or 0
+  int *fail;    // failure link: state of the longest proper suffix
+};
+
+// Initialize an automaton with room for max_states states, with only the
+// root.
+// On success, returns nonzero.
+// On failure, returns 0 and errno/errCause are set accordingly.
+static int automatonInit(struct automaton *a, int alphabet, int max_states) {
+  a->alphabet = alphabet;
+  a->num_states = 1;
+  a->next = (int *)malloc((size_t)max_states * alphabet * sizeof(int));
+  a->depth = (int *)malloc(4 * (size_t)max_states * sizeof(int));
+  if (!check(a->next != NULL && a->depth != NULL,
+             "Failed to allocate automaton")) {
+    free(a->next);
+    free(a->depth);
+    return 0;
+  }
+  a->pattern = a->depth + max_states;
+  a->dict = a->pattern + max_states;
+  a->fail = a->dict + max_states;
+  for (size_t i = 0; i < (size_t)alphabet; i++) {
+    a->next[i] = -1;
+  }
+  a->depth[0] = 0;
+  a->pattern[0] = -1;
+  return 1;
+}
+
+static void automatonDestroy(struct automaton *a) {
+  free(a->next);
+  free(a->depth);
+}
+
+// Returns the child of state for symbol in the trie of the patterns, adding
+// it if needed (while the automaton is being built).
+static int automatonChild(struct automaton *a, int state, int symbol) {
+  int *next = a->next + (size_t)state * a->alphabet;
+  if (next[symbol] < 0) {
+    const int child = a->num_states++;
+    int *child_next = a->next + (size_t)child * a->alphabet;
+    for (int c = 0; c < a->alphabet; c++) {
+      child_next[c] = -1;
+    }
+    a->depth[child] = a->depth[state] + 1;
+    a->pattern[child] = -1;
+    next[symbol] = child;
+  }
+  return next[symbol];
+}
+
+// Complete the automaton, once all patterns are in the trie: compute the
+// failure and dictionary links, and the missing transitions, in breadth-first
+// order (so the states of shorter prefixes are done first).
+// queue must have room for all states.
+static void automatonBuild(struct automaton *a, int *queue) {
+  const int alphabet = a->alphabet;
+  int head = 0;
+  int tail = 0;
+
+  a->fail[0] = 0;
+  a->dict[0] = 0;
+  for (int c = 0; c < alphabet; c++) {
+    const int child = a->next[c];
+    if (child < 0) {
+      a->next[c] = 0;
+    } else {
+      a->fail[child] = 0;
+      a->dict[child] = 0;
+      queue[tail++] = child;
+    }
+  }
+
+  while (head < tail) {
+    const int state = queue[head++];
+    int *next = a->next + (size_t)state * alphabet;
+    const int *fail_next = a->next + (size_t)a->fail[state] * alphabet;
+    for (int c = 0; c < alphabet; c++) {
+      const int child = next[c];
+      if (child < 0) {
+        next[c] = fail_next[c];
+      } else {
+        const int fail = fail_next[c];
+        a->fail[child] = fail;
+        a->dict[child] = a->pattern[fail] >= 0 ? fail : a->dict[fail];
+        queue[tail++] = child;
+      }
+    }
+  }
+}
+
+// Order of matches: raster order, then by index.
+static int matchCompare(const void *p1, const void *p2) {
+  const ImageMatch *m1 = (const ImageMatch *)p1;
+  const ImageMatch *m2 = (const ImageMatch *)p2;
+  if (m1->y != m2->y)
+    return m1->y < m2->y ? -1 : 1;
+  if (m1->x != m2->x)
+    return m1->x < m2->x ? -1 : 1;
+  return (m1->index > m2->index) - (m1->index < m2->index);
+}
+
+// Growable array of matches found by ImageLocateMany.
+struct matchList {
+  ImageMatch *matches;
+  size_t count;
+  size_t capacity;
+};
+
+// Append a match to list.
+// On success, returns nonzero.
+// On failure, returns 0 and errno/errCause are set accordingly.
+static int matchAppend(struct matchList *list, int x, int y, int index) {
+  if (list->count == list->capacity) {
+    const size_t capacity = list->capacity ? 2 * list->capacity : 64;
+    ImageMatch *matches = (ImageMatch *)realloc(
+        list->matches, capacity * sizeof(ImageMatch));
+    if (!check(matches != NULL, "Failed to allocate matches"))
+      return 0;
+    list->matches = matches;
+    list->capacity = capacity;
+  }
+  const ImageMatch match = {x, y, 0.0, index};
+  list->matches[list->count++] = match;
+  return 1;
+}
+
+// Search img for the subimages sub[index[0..count-1]], which all have the
+// same width w (Baker-Bird algorithm), and append their matches to list.
+//
+// The distinct rows of the subimages are the patterns of an Aho-Corasick
+// automaton over the levels, which finds, for each pixel of a row of img,
+// which of them (if any) ends there. Each subimage is then a string of row
+// ids, the patterns of a second automaton over row ids, which runs down each
+// column of ids and finds where the subimages end.
+// So img is read only once, and its pixels and columns advance the
+// automata in constant time each.
+//
+// On success, returns nonzero.
+// On failure, returns 0 and errno/errCause are set accordingly.
+static int locateGroup(Image img, Image *sub, const int *index, int count,
+                       struct matchList *list) {
+  const int w = sub[index[0]]->width;
+  const int width = img->width;
+  int success = 0;
+
+  // Automaton of the rows, over the levels that occur in the subimages:
+  // symbol[level] is 1 + the rank of the level among them, or 0 for the other
+  // levels (which no pattern contains).
+  // This keeps the transition table small, for subimages with few levels.
+  int symbol[256] = {0};
+  int max_row_states = 1;
+  int max_col_states = 1;
+  for (int i = 0; i < count; i++) {
+    const Image s = sub[index[i]];
+    for (int j = 0; j < ImageArea(s); j++) {
+      symbol[s->pixel[j]] = 1;
+    }
+    max_row_states += ImageArea(s);
+    max_col_states += s->height;
+  }
+  int alphabet = 1;
+  for (int level = 0; level < 256; level++) {
+    if (symbol[level])
+      symbol[level] = alphabet++;
+  }
+  struct automaton rows;
+  if (!automatonInit(&rows, alphabet, max_row_states))
+    return 0;
+
+  // The row ids of each subimage, from the row patterns in the trie
+  int *row_ids = (int *)malloc((size_t)(max_col_states + max_row_states) *
+                               sizeof(int));
+  int *queue = row_ids + max_col_states;
+  if (!check(row_ids != NULL, "Failed to allocate row ids")) {
+    automatonDestroy(&rows);
+    return 0;
+  }
+  int num_ids = 0;
+  int *ids = row_ids;
+  for (int i = 0; i < count; i++) {
+    const Image s = sub[index[i]];
+    for (int y = 0; y < s->height; y++) {
+      int state = 0;
+      for (int x = 0; x < w; x++) {
+        state = automatonChild(&rows, state, symbol[s->pixel[y * w + x]]);
+      }
+      if (rows.pattern[state] < 0)
+        rows.pattern[state] = num_ids++;
+      *ids++ = rows.pattern[state];
+    }
+  }
+  automatonBuild(&rows, queue);
+
+  // Automaton of the columns, whose patterns are the subimages.
+  // same[i] is another subimage equal to subimage index[i], or -1.
+  struct automaton cols;
+  int *same = (int *)malloc(count * sizeof(int));
+  if (check(same != NULL, "Failed to allocate automaton") &&
+      automatonInit(&cols, num_ids, max_col_states)) {
+    ids = row_ids;
+    for (int i = 0; i < count; i++) {
+      int state = 0;
+      for (int y = 0; y < sub[index[i]]->height; y++) {
+        state = automatonChild(&cols, state, *ids++);
+      }
+      same[i] = cols.pattern[state];
+      cols.pattern[state] = i;
+    }
+    automatonBuild(&cols, queue);
+
+    // State of the column automaton for each column, and the id of the row
+    // ending at each pixel of the current row
+    int *col_state = (int *)calloc(2 * (size_t)width, sizeof(int));
+    if (check(col_state != NULL, "Failed to allocate column states")) {
+      int *pixel_id = col_state + width;
+      success = 1;
+      for (int y = 0; y < img->height && success; y++) {
+        const uint8 *row = img->pixel + (size_t)y * width;
+        int state = 0;
+        for (int x = 0; x < width; x++) {
+          state = rows.next[(size_t)state * alphabet + symbol[row[x]]];
+          pixel_id[x] = rows.depth[state] == w ? rows.pattern[state] : -1;
+        }
+
+        for (int x = w - 1; x < width && success; x++) {
+          const int id = pixel_id[x];
+          const int cs = id < 0 ? 0 : cols.next[(size_t)col_state[x] * num_ids + id];
+          col_state[x] = cs;
+          for (int m = cols.pattern[cs] >= 0 ? cs : cols.dict[cs]; m != 0;
+               m = cols.dict[m]) {
+            for (int i = cols.pattern[m]; i >= 0 && success; i = same[i]) {
+              success = matchAppend(list, x - w + 1,
+                                    y - sub[index[i]]->height + 1, index[i]);
+            }
+          }
+        }
+      }
+      COUNT(PIXMEM, ImageArea(img)); // count pixel memory accesses
+      free(col_state);
+    }
+    automatonDestroy(&cols);
+  }
+
+  free(same);
+  free(row_ids);
+  automatonDestroy(&rows);
+  return success;
+}
+
+/// Locate several subimages at once.
+/// Searches for all subimages sub[0..count-1] inside img, in a single pass
+/// over img for each distinct subimage width.
+/// Requires: the subimages must not be empty.
+/// The matches are stored in matches[0..max-1], in raster order (and by
+/// subimage, for the same position), each with the index of its subimage in
+/// sub (and score 0).
+/// On success, returns the number of matches found (which may be more than
+/// max, then only the first max are stored).
+/// On failure, returns -1 and errno/errCause are set accordingly.
+int ImageLocateMany(Image img, Image *sub, int count, ImageMatch *matches,
+                    int max) { ///
+  assert(img != NULL);
+  assert(sub != NULL || count == 0);
+  assert(count >= 0);
+  assert(max >= 0);
+  assert(matches != NULL || max == 0);
+
+  // The subimages are searched in groups with the same width, since the rows
+  // of each group have the same length.
+  // index[] holds the indices of the subimages, sorted by width.
+  int *index = (int *)malloc((count > 0 ? count : 1) * sizeof(int));
+  if (!check(index != NULL, "Failed to allocate index"))
+    return -1;
+  for (int i = 0; i < count; i++) {
+    assert(sub[i] != NULL && ImageArea(sub[i]) > 0);
+    int j = i;
+    for (; j > 0 && sub[index[j - 1]]->width > sub[i]->width; j--) {
+      index[j] = index[j - 1];
+    }
+    index[j] = i;
+  }
+
+  struct matchList list = {NULL, 0, 0};
+  int success = 1;
+  for (int first = 0; first < count && success;) {
+    int last = first + 1;
+    while (last < count && sub[index[last]]->width == sub[index[first]]->width)
+      last++;
+    if (sub[index[first]]->width <= img->width)
+      success = locateGroup(img, sub, index + first, last - first, &list);
+    first = last;
+  }
+  free(index);
+
+  if (!success) {
+    free(list.matches);
+    return -1;
+  }
+
+  // (Only counting the matches, with max == 0, matches may be NULL.)
+  if (max > 0 && list.count > 0) {
+    qsort(list.matches, list.count, sizeof(ImageMatch), matchCompare);
+    memcpy(matches, list.matches,
+           (list.count < (size_t)max ? list.count : (size_t)max) *
+               sizeof(ImageMatch));
+  }
+  free(list.matches);
+  return (int)list.count;
+}
+
+// Locate the first of the subimages sub[0..count-1] inside img1, which all
+// contain level, by scanning the rows of img1 for that level, with memchr, and
+// matching each subimage where its first pixel with that level would be.
+// If a match is found, returns 1 and sets *match to the first one (in raster
+// order, and then by subimage).
+// If no match is found, returns 0.
+// This is an internal function, used by ImageLocateOriented.
+static int locateAnchorMany(Image img1, Image *sub, int count, uint8 level,
+                            ImageMatch *match) {
+  // The position of the anchor of each subimage
+  int anchor_x[8];
+  int anchor_y[8];
+  int max_anchor_y = 0;
+  assert(count <= 8);
+  for (int i = 0; i < count; i++) {
+    const uint8 *p = memchr(sub[i]->pixel, level, ImageArea(sub[i]));
+    assert(p != NULL);
+    anchor_x[i] = (p - sub[i]->pixel) % sub[i]->width;
+    anchor_y[i] = (p - sub[i]->pixel) / sub[i]->width;
+    if (anchor_y[i] > max_anchor_y)
+      max_anchor_y = anchor_y[i];
+    COUNT(PIXMEM, p - sub[i]->pixel + 1); // count pixel memory accesses
+  }
+
+  // The anchor rows are scanned in order, but the subimages anchored in a row
+  // start up to max_anchor_y rows above it, so the scan goes on for that many
+  // rows after the first match, to find any before it.
+  unsigned long compared = 0;
+  int found = 0;
+  for (int ay = 0; ay < img1->height &&
+                   (!found || ay <= match->y + max_anchor_y);
+       ay++) {
+    const uint8 *row = img1->pixel + G(img1, 0, ay);
+    const uint8 *end = row + img1->width;
+    for (const uint8 *p = row; (p = memchr(p, level, end - p)) != NULL; p++) {
+      for (int i = 0; i < count; i++) {
+        const int x = (p - row) - anchor_x[i];
+        const int y = ay - anchor_y[i];
+        if (x < 0 || y < 0 || x > img1->width - sub[i]->width ||
+            y > img1->height - sub[i]->height)
+          continue;
+        // (The subimages have different anchors, so at the same position a
+        // lower one may be found after a higher one.)
+        if (found &&
+            (y > match->y ||
+             (y == match->y &&
+              (x > match->x || (x == match->x && i >= match->index)))))
+          continue; // not before the match found
+        if (matchAt(img1, x, y, sub[i], &compared)) {
+          const ImageMatch m = {x, y, 0.0, i};
+          *match = m;
+          found = 1;
+        }
+      }
+    }
+    COUNT(PIXMEM, img1->width); // count pixel memory accesses
+  }
+  COUNT(PIXMEM, 2 * compared); // count two pixel accesses each
+  COUNT(GREYCMP, compared);
+
+  return found;
+}
+
+/// Locate a subimage in any of its 8 orientations.
+/// Searches for img2 inside img1, rotated 90º counter-clockwise r times
+/// (0 to 3) after being mirrored (m = 1) or not (m = 0), which is orientation
+/// 4 * m + r.
+/// The distinct orientations are searched together, so img1 is read once to
+/// find its rarest level in img2, and then once more for the positions of that
+/// level (if rare enough), or else at most twice by ImageLocateMany (once for
+/// each of the widths of img2 and of its rotation), rather than 8 times.
+/// If a match is found, returns 1 and the first matching position (in raster
+/// order) and its lowest orientation are set in vars (*px, *py, *porient).
+/// If no match is found, returns 0 and (*px, *py, *porient) are left
+/// untouched.
+/// On failure, returns -1 and errno/errCause are set accordingly.
+int ImageLocateOriented(Image img1, int *px, int *py, int *porient,
+                        Image img2) { ///
+  assert(img1 != NULL);
+  assert(img2 != NULL);
+  assert(px != NULL && py != NULL && porient != NULL);
+
+  if (ImageArea(img2) == 0) {
+    // Every orientation matches where img2 fits; take the first
+    const int found = ImageLocateSubImage(img1, px, py, img2);
+    if (found)
+      *porient = 0;
+    return found;
+  }
+
+  // The orientations, of which only the first of each set of equal ones is
+  // searched.
+  Image orient[8] = {img2};
+  orient[4] = ImageMirror(img2);
+  for (int m = 0; m < 2; m++) {
+    const Image base = orient[4 * m];
+    // The errno and errCause from the first failure will be propagated
+    if (base != NULL) {
+      orient[4 * m + 1] = ImageRotate(base);
+      orient[4 * m + 2] = ImageRotate180(base);
+      orient[4 * m + 3] = ImageRotate270(base);
+    }
+  }
+  int success = 1;
+  for (int o = 0; o < 8; o++) {
+    success = success && orient[o] != NULL;
+  }
+
+  int found = -1;
+  if (success) {
+    Image sub[8];
+    int sub_orient[8];
+    int count = 0;
+    for (int o = 0; o < 8; o++) {
+      int distinct = 1;
+      for (int i = 0; i < count && distinct; i++) {
+        distinct = sub[i]->width != orient[o]->width ||
+                   sub[i]->height != orient[o]->height ||
+                   memcmp(sub[i]->pixel, orient[o]->pixel,
+                          (size_t)ImageArea(orient[o])) != 0;
+      }
+      if (distinct) {
+        sub[count] = orient[o];
+        sub_orient[count++] = o;
+      }
+    }
+
+    // All orientations have the same levels, so they share the anchor level
+    // (if it is rare enough), and else they are searched by ImageLocateMany.
+    struct anchor anchor;
+    findAnchor(&anchor, img1, img2);
+    double candidates = 0.0;
+    for (int i = 0; i < count; i++) {
+      if (sub[i]->width <= img1->width && sub[i]->height <= img1->height)
+        candidates += (double)(img1->width - sub[i]->width + 1) *
+                      (img1->height - sub[i]->height + 1);
+    }
+    const int area = ImageArea(img2);
+    const int match_cost = area < ANCHOR_MATCH_COST ? area : ANCHOR_MATCH_COST;
+    ImageMatch match;
+    if (candidates == 0.0) {
+      found = 0;
+    } else if ((double)anchor.hits * count * match_cost <
+               candidates * ANCHOR_MAX_COST) {
+      found = locateAnchorMany(img1, sub, count, anchor.level, &match);
+    } else {
+      found = ImageLocateMany(img1, sub, count, &match, 1);
+    }
+    if (found > 0) {
+      *px = match.x;
+      *py = match.y;
+      *porient = sub_orient[match.index];
+      found = 1;
+    }
+  }
+
+  for (int o = 1; o < 8; o++) {
+    ImageDestroy(&orient[o]);
+  }
+  return found;
+}
+
+/// Filtering
+
+// Division of the filter window sums by the window area, rounded as
+// round_div does, but exactly with a multiplication and a shift: the rounded
+// quotient of sum by area is floor(n / d), for n = 2 * sum + area and
+// d = 2 * area, and with shift = 31 + ceil(log2(d)) and
+// mul = ceil(2^shift / d), floor(n / d) = (n * mul) >> shift for all
+// n < 2^31 (Granlund and Montgomery), so when 511 * area < 2^31, since
+// sum <= 255 * area.
+// For larger windows mul is 0, and round_div is used.
+struct blurDivisor {
+  int area;
+  int shift;
+  uint64_t mul;
+};
+
+static void blurDivisorInit(struct blurDivisor *div, int area) {
+  div->area = area;
+  div->shift = 0;
+  div->mul = 0;
+  if (511 * (int64_t)area < ((int64_t)1 << 31)) {
+    const uint64_t d = 2 * (uint64_t)area;
+    int log2_d = 0;
+    while (((uint64_t)1 << log2_d) < d)
+      log2_d++;
+    div->shift = 31 + log2_d;
+    div->mul = (((uint64_t)1 << div->shift) + d - 1) / d;
+  }
+}
+
+static inline uint8 blurDivide(const struct blurDivisor *div, int sum) {
+  if (div->mul != 0)
+    return (uint8)(((uint64_t)(2 * sum + div->area) * div->mul) >> div->shift);
+  return (uint8)round_div(sum, div->area);
+}
+
+// Horizontal pass of the mean filter for a single line.
+// Computes the blurred values of pixels [x_begin, x_end[ of a line of width
+// pixels into out (the whole line), given the sums of the 1D filter spanning
+// the y axis for each pixel of the line (line_sum, starting at pixel first,
+// with those of the pixels in the filter windows), the x radius of the filter
+// and the divisor for the filter window area.
+// The first pixel of the line is initialized as described below, and any
+// other first pixel from the (2dx+1) sums of its filter window, clamped to the
+// line, which gives the same sum when dx >= 1 and width > 1.
+// This is an internal function, used by ImageBlur and ImageStreamBlur.
+// It does not count the pixel accesses (writes) and divisions, since it may
+// run on multiple threads: the callers count them.
+static void blurRow(uint8 *out, const int *line_sum, int first, int x_begin,
+                    int x_end, int width, int dx,
+                    const struct blurDivisor *div) {
+  // The last valid index in the x axis
+  const int last_x = width - 1;
+  int sum = 0;
+
+  if (x_begin == 0) {
+    // The effective radius to consider when fetching sums from memory.
+    const int radius_x = width > dx ? dx : last_x;
+    // The size of the filter window that exceeds the image size plus 1.
+    const int spill_x = dx >= width ? dx - radius_x + 1 : 1;
+
+    // Finally the blurred pixel value will be calculated, this is done by
+    // first calculating the sum for the first pixel (by summing the values of
+    // vertical filter inside the horizontal filter window), this will be used
+    // not only for the blurred value of the first pixel but also for
+    // accumulation on subsequent pixels.
+
+    // Here, as when calculating the initial values for the sum vector, we
+    // multiply the first and last pixel values for the part of the filter
+    // window that is out of bounds instead of making multiple clamped reads.
+    // All pixels in the effective memory region are read normally and their
+    // value added to the sum.
+    sum = (dx + 1) * line_sum[0];
+    for (int half_win_x = 1; half_win_x < radius_x; half_win_x++) {
+      sum += line_sum[half_win_x];
+    }
+    sum += spill_x * line_sum[radius_x];
+  } else {
+    for (int wx = x_begin - dx; wx <= x_begin + dx; wx++) {
+      sum += line_sum[clamp(wx, 0, last_x) - first];
+    }
+  }
+
+  // Calculate the blurred value by dividing the sum by the window area and
+  // store it in the blurred pixels memory.
+  out[x_begin] = blurDivide(div, sum);
+
+  // For all remaining pixels in the line update the sum by removing the first
+  // pixel in the previous filter window and adding the new pixel and. Then
+  // the blurred pixel value is calculated and updated as done previously.
+  //
+  // The line is split where the window crosses the borders, so that no
+  // position needs to be clamped: first the pixels whose window starts
+  // before the line (and those whose window also ends after it, on lines
+  // shorter than the window), then the interior ones, and then those whose
+  // window ends after the line.
+  // (The sums start at the first pixel of the line for the former.)
+  int x = x_begin + 1;
+  for (; x < x_end && x <= dx && x + dx <= last_x; x++) {
+    sum += line_sum[x + dx - first] - line_sum[0];
+    out[x] = blurDivide(div, sum);
+  }
+  for (; x < x_end && x <= dx; x++) {
+    sum += line_sum[last_x - first] - line_sum[0];
+    out[x] = blurDivide(div, sum);
+  }
+  for (; x < x_end && x + dx <= last_x; x++) {
+    sum += line_sum[x + dx - first] - line_sum[x - dx - 1 - first];
+    out[x] = blurDivide(div, sum);
+  }
+  for (; x < x_end; x++) {
+    sum += line_sum[last_x - first] - line_sum[x - dx - 1 - first];
+    out[x] = blurDivide(div, sum);
+  }
+}
+
+// Add the differences add[x] - sub[x] of two rows of n pixels to the sums
+// line_sum[x], which is the update phase of the mean filter (see ImageBlur).
+static void addRowDifference(int *line_sum, const uint8 *add, const uint8 *sub,
+                             int n) {
+  int x = 0;
+#ifdef __SSE2__
+  // 16 pixels at a time: their differences fit in 16 bits, and are then sign
+  // extended to 32 bits to be added to the sums.
+  const __m128i zero = _mm_setzero_si128();
+  for (; x + 16 <= n; x += 16) {
+    const __m128i va = _mm_loadu_si128((const __m128i *)(add + x));
+    const __m128i vs = _mm_loadu_si128((const __m128i *)(sub + x));
+    const __m128i lo = _mm_sub_epi16(_mm_unpacklo_epi8(va, zero),
+                                     _mm_unpacklo_epi8(vs, zero));
+    const __m128i hi = _mm_sub_epi16(_mm_unpackhi_epi8(va, zero),
+                                     _mm_unpackhi_epi8(vs, zero));
+    const __m128i diff[4] = {
+        _mm_srai_epi32(_mm_unpacklo_epi16(lo, lo), 16),
+        _mm_srai_epi32(_mm_unpackhi_epi16(lo, lo), 16),
+        _mm_srai_epi32(_mm_unpacklo_epi16(hi, hi), 16),
+        _mm_srai_epi32(_mm_unpackhi_epi16(hi, hi), 16),
+    };
+    for (int i = 0; i < 4; i++) {
+      __m128i *sum = (__m128i *)(line_sum + x + 4 * i);
+      _mm_storeu_si128(sum, _mm_add_epi32(_mm_loadu_si128(sum), diff[i]));
+    }
+  }
+#endif
+  for (; x < n; x++) {
+    line_sum[x] += add[x] - sub[x];
+  }
+}
+
+// Minimum number of pixels for a blur to run in parallel
+#define BLUR_PARALLEL_MIN (1 << 16)
+
+// Number of columns blurred at a time, so that their sums (4 bytes each) and
+// the rows of pixels read and written for them stay in the L1/L2 caches on
+// wide images.
+// Each strip also needs the sums of dx columns on each side, so it is made at
+// least 4dx wide, to keep that overhead small.
+#define BLUR_STRIP_WIDTH 2048
+
+// Width of the column strips for blurring an image of the given width with x
+// radius dx, and so the number of sums for each (with dx more on each side).
+// When dx is 0 or the image has a single column, the first pixel of each row
+// is initialized differently from the others (see blurRow), and the whole
+// rows are blurred at once.
+static int blurStripWidth(int width, int dx) {
+  if (dx == 0 || width < 2)
+    return width;
+  const int strip = BLUR_STRIP_WIDTH > 4 * dx ? BLUR_STRIP_WIDTH : 4 * dx;
+  return strip < width ? strip : width;
+}
+
+// Initialize the sums of the 1D filter spanning the y axis with radius dy
+// for columns [sum_begin, sum_begin + num_sums[ of the first row of img into
+// line_sum.
+// Returns the number of pixels read.
+// This is an internal function, used by ImageBlur and ImageBlurInPlace.
+static unsigned long blurFirstSums(Image img, int *line_sum, int sum_begin,
+                                   int num_sums, int dy) {
+  // The last valid index in the y axis
+  const int last_y = img->height - 1;
+
+  // The effective radius to consider when fetching pixels from memory for
+  // the filter sum.
+  const int radius_y = img->height > dy ? dy : last_y;
+
+  // The size of the filter window that exceeds the image size plus 1.
+  const int spill_y = dy >= img->height ? dy - radius_y + 1 : 1;
+
+  // Initialization phase
+  //
+  // This phase is responsible for initializing the sum vector that will be
+  // used throughout the algorithm. In here the sum of 1D filter in the y
+  // axis will be calculated for all pixels in the first line.
+  //
+  // The principle of accumulation can't be used here since we don't have a
+  // previous value so each pixel in the window will read and it's value
+  // added to the sum on the corresponding position.
+  //
+  // The rows are read one at a time, so that the memory accesses are
+  // sequential.
+
+  // The first pixel value will appear once in it's position but also y
+  // radius of the filter window times, because we are considering a border
+  // clamp sampling of the pixels, this means that all out of bounds pixel
+  // accesses will be mapped to the nearest pixel.
+  const uint8 *first = img->pixel + sum_begin;
+  for (int x = 0; x < num_sums; x++) {
+    line_sum[x] = (dy + 1) * first[x];
+  }
+
+  // Each of the pixels in the effective radius will be added to the sum we
+  // are calculating minus the last.
+  for (int half_win_y = 1; half_win_y < radius_y; half_win_y++) {
+    const uint8 *row = img->pixel + G(img, sum_begin, half_win_y);
+    for (int x = 0; x < num_sums; x++) {
+      line_sum[x] += row[x];
+    }
+  }
+
+  // The last pixel will, like the first pixel, not only appear once but
+  // also as many times as the filter window exceeds the image size.
+  const uint8 *last = img->pixel + G(img, sum_begin, radius_y);
+  for (int x = 0; x < num_sums; x++) {
+    line_sum[x] += spill_y * last[x];
+  }
+  // count the pixel accesses (the first and last may be the same pixel)
+  return (unsigned long)num_sums * ((radius_y > 1 ? radius_y : 1) + 1);
+}
+
+// Blur the columns [x_begin, x_end[ of rows [y_begin, y_end[ of img, writing
+// them to out (the blurred pixels of the whole image), with line_sum as the
+// sum vector, for the columns in their filter windows.
+// Returns the number of pixels read.
+// This is an internal function, used by blurBand.
+static unsigned long blurStrip(Image img, uint8 *out, int *line_sum, int dx,
+                               int dy, int x_begin, int x_end, int y_begin,
+                               int y_end) {
+  // The columns whose sums are needed: [sum_begin, sum_end[
+  const int sum_begin = x_begin - dx > 0 ? x_begin - dx : 0;
+  const int sum_end = x_end + dx < img->width ? x_end + dx : img->width;
+  const int num_sums = sum_end - sum_begin;
+  unsigned long pixmem = 0;
+
+  // The last valid index in the y axis
+  const int last_y = img->height - 1;
+
+  // The filter window sizes and areas.
+  const int win_width = 2 * dx + 1;
+  const int win_height = 2 * dy + 1;
+  const int win_area = win_width * win_height;
+  struct blurDivisor div;
+  blurDivisorInit(&div, win_area);
+
+  if (y_begin == 0) {
+    pixmem += blurFirstSums(img, line_sum, sum_begin, num_sums, dy);
+  } else {
+    // Seed the sum vector from the halo rows, clamped to the image.
+    memset(line_sum, 0, num_sums * sizeof(int));
+    for (int wy = y_begin - dy; wy <= y_begin + dy; wy++) {
+      const uint8 *row = img->pixel + G(img, sum_begin, clamp(wy, 0, last_y));
+      for (int x = 0; x < num_sums; x++) {
+        line_sum[x] += row[x];
+      }
+    }
+    pixmem += (unsigned long)num_sums * win_height;
+  }
+
+  // From this point on each line will be treated individually to calculate
+  // it's blurred values.
+  for (int y = y_begin; y < y_end; y++) {
+    // NOTE: This part could be made more efficient (in run time, not number
+    // of operations), by performing all other operations except this if for
+    // the first line, having this loop start at 1 and then removing the if.
+    //
+    // This would remove a conditional from the hot code path, but increase
+    // the code size of the function.
+    if (y != y_begin) {
+      // Update phase
+      //
+      // For all lines, except the first, the sum vector will need to be
+      // updated with the new pixels value. But as we already have a previous
+      // sum for the last line, we don't need to consider all pixels instead we
+      // only subtract the first pixel of the previous window and add the last
+      // pixel of the current window.
+
+      // The read coordinates need to be clamped to the image size.
+      const int prev_y = clamp(y - dy - 1, 0, last_y);
+      const int next_y = clamp(y + dy, 0, last_y);
+
+      addRowDifference(line_sum, img->pixel + G(img, sum_begin, next_y),
+                       img->pixel + G(img, sum_begin, prev_y), num_sums);
+      pixmem += 2 * (unsigned long)num_sums; // count two pixel accesses each
+    }
+
+    // Blur phase
+    //
+    // Finally the blurred pixel values of the line are calculated from the
+    // sum vector (see blurRow).
+    blurRow(out + (size_t)y * img->width, line_sum, sum_begin, x_begin, x_end,
+            img->width, dx, &div);
+  }
+
+  return pixmem;
+}
+
+// Specialized kernels for small windows
+//
+// For the most common radii the blur is done by kernels where the radii are
+// compile time constants, generated by the BLUR_KERNEL macro, which are
+// picked by blurBand.
+// Each row is computed directly from the (2DY+1) rows of its window, a chunk
+// of columns at a time: first the vertical sums of each column, then the sums
+// of the (2DX+1) vertical sums around each pixel, which are divided by the
+// window area, as round_div does: floor((2 * sum + area) / (2 * area)).
+// All of these fit in 16 bits (the window has at most 49 pixels), and have
+// constant trip counts, so the compiler unrolls and vectorizes the loops
+// (dividing by a constant with a multiplication) without any running sums
+// carried from pixel to pixel.
+// The sums of the windows clamped to the image are the same as those of the
+// running sums when dx, dy >= 1 and the image has at least 2 rows and
+// columns, so the kernels are only used then, with the same result.
+// They are also counted as the running sums would be (see blurStripReads), so
+// that the instrumentation does not depend on which way a blur is done.
+
+// Number of columns whose vertical sums are computed at a time by the
+// kernels.
+#define BLUR_KERNEL_CHUNK 1024
+
+// Kernel that blurs rows [y_begin, y_end[ of img, writing them to out (the
+// blurred pixels of the whole image).
+typedef void blurKernel(Image img, uint8 *out, int y_begin, int y_end);
+
+#define BLUR_KERNEL(DX, DY)                                                    \
+  static void blurKernel##DX##x##DY(Image img, uint8 *out, int y_begin,        \
+                                    int y_end) {                               \
+    const int width = img->width;                                              \
+    const int last_x = width - 1;                                              \
+    const int last_y = img->height - 1;                                        \
+    const uint16_t area = (2 * DX + 1) * (2 * DY + 1);                         \
+    uint16_t sums[BLUR_KERNEL_CHUNK + 2 * DX];                                 \
+                                                                               \
+    for (int y = y_begin; y < y_end; y++) {                                    \
+      const uint8 *rows[2 * DY + 1];                                           \
+      for (int k = 0; k <= 2 * DY; k++) {                                      \
+        rows[k] = img->pixel + G(img, 0, clamp(y - DY + k, 0, last_y));        \
+      }                                                                        \
+      uint8 *row_out = out + (size_t)y * width;                                \
+                                                                               \
+      for (int chunk = 0; chunk < width; chunk += BLUR_KERNEL_CHUNK) {         \
+        const int chunk_end = width - chunk < BLUR_KERNEL_CHUNK                \
+                                  ? width                                      \
+                                  : chunk + BLUR_KERNEL_CHUNK;                 \
+        /* The columns whose vertical sums are needed */                       \
+        const int sum_begin = chunk - DX > 0 ? chunk - DX : 0;                 \
+        const int sum_end = chunk_end + DX < width ? chunk_end + DX : width;   \
+        for (int x = sum_begin; x < sum_end; x++) {                            \
+          uint16_t sum = 0;                                                    \
+          for (int k = 0; k <= 2 * DY; k++) {                                  \
+            sum += rows[k][x];                                                 \
+          }                                                                    \
+          sums[x - sum_begin] = sum;                                           \
+        }                                                                      \
+                                                                               \
+        /* The pixels whose windows are inside the image, and those on the */  \
+        /* borders, whose columns are clamped */                               \
+        const int inner_begin = chunk > DX ? chunk : DX;                       \
+        const int inner_end =                                                  \
+            chunk_end < width - DX ? chunk_end : width - DX;                   \
+        const int border_end =                                                 \
+            chunk_end < inner_begin ? chunk_end : inner_begin;                 \
+        const int border_begin =                                               \
+            inner_end > inner_begin ? inner_end : inner_begin;                 \
+        for (int x = chunk; x < border_end; x++) {                             \
+          uint16_t sum = 0;                                                    \
+          for (int k = -DX; k <= DX; k++) {                                    \
+            sum += sums[clamp(x + k, 0, last_x) - sum_begin];                  \
+          }                                                                    \
+          row_out[x] = (uint8)((2 * sum + area) / (2 * area));                 \
+        }                                                                      \
+        for (int x = inner_begin; x < inner_end; x++) {                        \
+          uint16_t sum = 0;                                                    \
+          for (int k = -DX; k <= DX; k++) {                                    \
+            sum += sums[x + k - sum_begin];                                    \
+          }                                                                    \
+          row_out[x] = (uint8)((uint16_t)(2 * sum + area) / (2 * area));       \
+        }                                                                      \
+        for (int x = border_begin; x < chunk_end; x++) {                       \
+          uint16_t sum = 0;                                                    \
+          for (int k = -DX; k <= DX; k++) {                                    \
+            sum += sums[clamp(x + k, 0, last_x) - sum_begin];                  \
+          }                                                                    \
+          row_out[x] = (uint8)((2 * sum + area) / (2 * area));                 \
+        }                                                                      \
+      }                                                                        \
+    }                                                                          \
+  }
+
+BLUR_KERNEL(1, 1)
+BLUR_KERNEL(2, 2)
+BLUR_KERNEL(3, 3)
+
+// The specialized kernel for blurring img with radii dx and dy, or NULL.
+static blurKernel *blurKernelFor(Image img, int dx, int dy) {
+  if (img->width < 2 || img->height < 2 || dx != dy)
+    return NULL;
+  switch (dx) {
+  case 1:
+    return blurKernel1x1;
+  case 2:
+    return blurKernel2x2;
+  case 3:
+    return blurKernel3x3;
+  default:
+    return NULL;
+  }
+}
+
+// The number of pixels read by blurStrip for the same arguments, without
+// reading them.
+// This is an internal function, used by blurBand.
+static unsigned long blurStripReads(Image img, int dx, int dy, int x_begin,
+                                    int x_end, int y_begin, int y_end) {
+  const int sum_begin = x_begin - dx > 0 ? x_begin - dx : 0;
+  const int sum_end = x_end + dx < img->width ? x_end + dx : img->width;
+  const int radius_y = img->height > dy ? dy : img->height - 1;
+  // The rows read to initialize the sum vector (see blurFirstSums), and then
+  // two for each update
+  const int first = y_begin == 0 ? (radius_y > 1 ? radius_y : 1) + 1
+                                 : 2 * dy + 1;
+  return (unsigned long)(sum_end - sum_begin) *
+         (first + 2 * (unsigned long)(y_end - y_begin - 1));
+}
+
+// Blur rows [y_begin, y_end[ of img, writing them to out (the blurred pixels
+// of the whole image), with the specialized kernel for dx and dy, if any, or
+// else a strip of columns at a time, with line_sum as the sum vector (for the
+// strip width, as given by blurStripWidth, plus 2dx).
+// The first row of the image is initialized as described in ImageBlur, and
+// any other first row from the (2dy+1) rows of its filter window (its halo),
+// clamped to the image, which gives the same sums when dy >= 1 and the image
+// has more than one row.
+// Returns the number of pixels read by the strips, even when the kernel is
+// used (the callers count the pixels written).
+// This is an internal function, used by ImageBlur.
+static unsigned long blurBand(Image img, uint8 *out, int *line_sum, int dx,
+                              int dy, int y_begin, int y_end) {
+  const int strip = blurStripWidth(img->width, dx);
+  unsigned long pixmem = 0;
+  if (y_begin == y_end)
+    return 0; // there is no first row to initialize
+
+  blurKernel *kernel = blurKernelFor(img, dx, dy);
+  if (kernel != NULL)
+    kernel(img, out, y_begin, y_end);
+
+  for (int x_begin = 0; x_begin < img->width; x_begin += strip) {
+    const int x_end =
+        img->width - x_begin < strip ? img->width : x_begin + strip;
+    if (kernel != NULL)
+      pixmem += blurStripReads(img, dx, dy, x_begin, x_end, y_begin, y_end);
+    else
+      pixmem += blurStrip(img, out, line_sum, dx, dy, x_begin, x_end,
+                          y_begin, y_end);
+  }
+  return pixmem;
+}
+
+// State of a blur by ImageBlur, shared by the threads doing it.
+// The rows are split in bands, taken in order by the threads, each of which
+// blurs its bands independently, with its own sum vector.
+struct blurJob {
+  Image img;
+  uint8 *out;
+  int dx;
+  int dy;
+  int rows_per_band;      // number of rows in each band
+  int sums_size;          // number of sums in each sum vector
+  int *line_sums;         // a sum vector for each thread
+  atomic_int next_band;   // index of the next band to blur
+  atomic_int next_buffer; // index of the next unused sum vector
+  atomic_ulong pixmem;    // pixel reads, added by each thread at the end
+};
+
+// Blur bands of rows until there are none left.
+static void *blurWorker(void *arg) {
+  struct blurJob *job = (struct blurJob *)arg;
+  const Image img = job->img;
+  int *line_sum = job->line_sums + (size_t)job->sums_size *
+                                       atomic_fetch_add(&job->next_buffer, 1);
+  unsigned long pixmem = 0;
+
+  for (;;) {
+    const int y_begin =
+        atomic_fetch_add(&job->next_band, 1) * job->rows_per_band;
+    if (y_begin >= img->height)
+      break;
+    const int y_end = img->height - y_begin < job->rows_per_band
+                          ? img->height
+                          : y_begin + job->rows_per_band;
+    pixmem += blurBand(img, job->out, line_sum, job->dx, job->dy, y_begin,
+                       y_end);
+  }
+
+  atomic_fetch_add(&job->pixmem, pixmem);
+  return NULL;
+}
+
+/// Blur an image by a applying a (2dx+1)x(2dy+1) mean filter.
+/// Each pixel is substituted by the mean of the pixels in the rectangle
+/// [x-dx, x+dx]x[y-dy, y+dy].
+/// The image is changed in-place.
+/// Large images are blurred by as many threads as set by ImageSetThreads,
+/// each doing bands of rows, with the same result.
+/// Only the square 3x3, 5x5 and 7x7 windows (dx == dy, from 1 to 3) are
+/// blurred by specialized kernels, which give the same result and counts;
+/// any other window, such as 3x5, is blurred with running sums.
+void ImageBlur(Image img, int dx, int dy) {
+  assert(img != NULL);
+  assert(dx >= 0 && dy >= 0);
+
+  // The blurred pixels will be written to a separate array that will be swapped
+  // at the end because the original pixels values will be needed at all times.
+  const size_t num_pixels = sizeof(uint8) * ImageArea(img);
+  uint8 *blurred_pixels = (uint8 *)malloc(num_pixels);
+
+  if (check(blurred_pixels == NULL, "Failed to allocate memory"))
+    return;
 
   // The algorithm implemented here is based on the ideas of the
   // FMF/FMFT (Fast Mean Filter).
@@ -716,126 +3480,1264 @@ void ImageBlur(Image img, int dx, int dy) {
   //
   // All of these together allows us to design a filter that is essentially
   // independent of the window size, except for a small initialization step.
+  //
+  // Each row only depends on the sum vector of the previous one, so the rows
+  // can be split in bands that are blurred in parallel, each band starting
+  // from the sums of the (2dy+1) rows around its first row (see blurBand).
+  // Only the first row's initialization differs from that when dy is 0 or
+  // there is a single row, so then the image is blurred as a single band.
+  int workers = threadCount();
+  if (dy == 0 || img->height < 2 || num_pixels < BLUR_PARALLEL_MIN)
+    workers = 1;
+
+  // Bands should have at least as many rows as the filter window, so that
+  // seeding their sums costs no more than blurring them, and there should be
+  // a few bands for each thread, to balance their work.
+  struct blurJob job;
+  job.rows_per_band = img->height;
+  if (workers > 1) {
+    const int rows = (img->height + 4 * workers - 1) / (4 * workers);
+    job.rows_per_band = rows > 2 * dy + 1 ? rows : 2 * dy + 1;
+    const int num_bands =
+        (img->height + job.rows_per_band - 1) / job.rows_per_band;
+    if (workers > num_bands)
+      workers = num_bands;
+  }
+
+  // Arrays of the sums used for the 1D filter spanning the y axis with radius
+  // dy, one for each thread, for a strip of columns (see blurBand).
+  // If there is not enough memory for them, the image is blurred by a single
+  // thread.
+  const int strip = blurStripWidth(img->width, dx);
+  job.sums_size = strip + 2 * dx < img->width ? strip + 2 * dx : img->width;
+  job.line_sums =
+      (int *)malloc((size_t)workers * job.sums_size * sizeof(int));
+  if (job.line_sums == NULL && workers > 1) {
+    workers = 1;
+    job.line_sums = (int *)malloc(job.sums_size * sizeof(int));
+  }
+  if (!check(job.line_sums != NULL || job.sums_size == 0,
+             "Failed to allocate memory")) {
+    free(blurred_pixels);
+    return;
+  }
+
+  unsigned long pixmem;
+  if (workers > 1) {
+    job.img = img;
+    job.out = blurred_pixels;
+    job.dx = dx;
+    job.dy = dy;
+    atomic_init(&job.next_band, 0);
+    atomic_init(&job.next_buffer, 0);
+    atomic_init(&job.pixmem, 0);
+    runWorkers(blurWorker, &job, workers);
+    pixmem = atomic_load(&job.pixmem);
+  } else {
+    pixmem = blurBand(img, blurred_pixels, job.line_sums, dx, dy, 0,
+                      img->height);
+  }
+  free(job.line_sums);
+  COUNT(PIXMEM, pixmem + num_pixels); // count the reads, and one write each
+  COUNT(DIVISIONS, num_pixels);
+
+  // At this point blurred_pixels contains the new values and the old pixels
+  // memory is no longer useful so it's released and the pointer is replaced.
+  ImageReleasePixels(img);
+  img->pixel = blurred_pixels;
+}
+
+/// Blur an image in place, as ImageBlur does, without a second raster.
+/// Only a ring with the last (dy+1) original rows still needed is kept, so
+/// the extra memory is O(width*dy) instead of O(width*height) (the whole
+/// rows are needed, so this is done by a single thread).
+/// On success, returns nonzero.
+/// On failure, returns 0, the image is unchanged and errno/errCause are set
+/// accordingly.
+int ImageBlurInPlace(Image img, int dx, int dy) { ///
+  assert(img != NULL);
+  assert(dx >= 0 && dy >= 0);
+
+  const int width = img->width;
+  const int height = img->height;
+  if (ImageArea(img) == 0)
+    return 1;
+
+  // Row y is overwritten after its sum vector is computed, which needs the
+  // original rows y-dy-1 (leaving the window) and y+dy (entering it): the
+  // latter is not overwritten yet, and the former is kept in the ring, where
+  // row r is stored in the slot r % (dy+1) just before it is overwritten
+  // (rows above the image are clamped to row 0, which stays in the ring
+  // until row dy+1 replaces it, when it is no longer needed).
+  const int ring_rows = dy + 1 < height ? dy + 1 : height;
+  uint8 *ring = (uint8 *)malloc((size_t)ring_rows * width * sizeof(uint8));
+  int *line_sum = (int *)malloc(width * sizeof(int));
+  if (!check(ring != NULL && line_sum != NULL, "Failed to allocate memory")) {
+    free(ring);
+    free(line_sum);
+    return 0;
+  }
+
+  const int last_y = height - 1;
+  struct blurDivisor div;
+  blurDivisorInit(&div, (2 * dx + 1) * (2 * dy + 1));
+
+  // Initialization phase (see ImageBlur)
+  unsigned long pixmem = blurFirstSums(img, line_sum, 0, width, dy);
+
+  for (int y = 0; y < height; y++) {
+    uint8 *row = img->pixel + G(img, 0, y);
+    if (y != 0) {
+      // Update phase (see ImageBlur), with the leaving row from the ring
+      const int prev_y = clamp(y - dy - 1, 0, last_y);
+      const int next_y = clamp(y + dy, 0, last_y);
+      addRowDifference(line_sum, img->pixel + G(img, 0, next_y),
+                       ring + (size_t)(prev_y % ring_rows) * width, width);
+    }
+
+    // Keep the original row before it is overwritten by the blur phase
+    memcpy(ring + (size_t)(y % ring_rows) * width, row, width);
+    blurRow(row, line_sum, 0, 0, width, width, dx, &div);
+  }
+  // count two pixel accesses for each update, and a read and a write for
+  // each pixel
+  pixmem += 2 * (unsigned long)width * (height - 1) + 2 * ImageArea(img);
+  COUNT(PIXMEM, pixmem);
+  COUNT(DIVISIONS, ImageArea(img));
+
+  free(ring);
+  free(line_sum);
+  return 1;
+}
+
+/// Blur an image with a different mean filter for each pixel.
+/// Each pixel (x, y) is substituted by the mean of the pixels in the square
+/// [x-r, x+r]x[y-r, y+r], where r is the level of pixel (x, y) of radius,
+/// with the pixels outside the image clamped to its border, as in ImageBlur
+/// (so, for a radius image with a single level r >= 1, the result is the
+/// same as ImageBlur(img, r, r), for images with at least 2 rows and
+/// columns).
+/// The means come from the integral image of img, in constant time.
+/// Requires: radius must have the same size as img.
+/// On success, returns nonzero.
+/// On failure, returns 0, the image is unchanged and errno/errCause are set
+/// accordingly.
+int ImageBlurRadiusMap(Image img, Image radius) { ///
+  assert(img != NULL);
+  assert(radius != NULL);
+  assert(radius->width == img->width && radius->height == img->height);
+
+  ImageIntegral ii = ImageIntegralCreate(img, 0);
+  uint8 *blurred_pixels = (uint8 *)malloc(ImageArea(img) * sizeof(uint8));
+  if (ii == NULL ||
+      !check(blurred_pixels != NULL || ImageArea(img) == 0,
+             "Failed to allocate memory")) {
+    ImageIntegralDestroy(&ii);
+    free(blurred_pixels);
+    return 0;
+  }
+
+  for (int y = 0; y < img->height; y++) {
+    for (int x = 0; x < img->width; x++) {
+      const int r = radius->pixel[G(radius, x, y)];
+      const uint64_t area = (uint64_t)(2 * r + 1) * (2 * r + 1);
+      const uint64_t sum = ImageRectSum(ii, x - r, y - r, 2 * r + 1, 2 * r + 1);
+      // rounded as round_div does
+      blurred_pixels[G(img, x, y)] = (uint8)((2 * sum + area) / (2 * area));
+    }
+  }
+  // count a read of the radius and a write for each pixel
+  COUNT(PIXMEM, 2 * ImageArea(img));
+  COUNT(DIVISIONS, ImageArea(img));
+
+  ImageIntegralDestroy(&ii);
+  ImageReleasePixels(img);
+  img->pixel = blurred_pixels;
+  return 1;
+}
 
-  // Array of the sums used for the 1D filter spanning the y axis with radius
-  // dy.
-  int line_sum[img->width];
+// Gaussian blur by iterated box filters.
+// By the central limit theorem, GAUSS_PASSES box filters in a row approach a
+// Gaussian filter, and their widths can be chosen so that the variances add
+// up to sigma^2. Each box filter is done with running sums, as in ImageBlur,
+// so the cost does not depend on sigma. Between passes the levels are kept in
+// 16 bits, with GAUSS_FRACTION_BITS fractional bits, so that the rounding
+// errors do not add up as they would if each pass was rounded to 8 bits.
+#define GAUSS_PASSES 3
+#define GAUSS_FRACTION_BITS 8
+#define GAUSS_MAX_SIGMA 10000.0
+#define GAUSS_ROW_BLOCK 16
 
-  // The last valid index in each axis
-  int last_x = img->width - 1;
-  int last_y = img->height - 1;
+// Compute the radii of the GAUSS_PASSES box filters that approximate a
+// Gaussian filter with standard deviation sigma.
+// The widths are the two consecutive odd numbers wl and wl+2 around the ideal
+// width, with the number of each that brings the total variance closest to
+// sigma^2.
+static void gaussBoxRadii(double sigma, int radius[GAUSS_PASSES]) {
+  const int n = GAUSS_PASSES;
+  const double ideal = sqrt(12.0 * sigma * sigma / n + 1.0);
+  int wl = (int)floor(ideal);
+  if (wl % 2 == 0)
+    wl--;
+  const double variance = 12.0 * sigma * sigma;
+  const double m =
+      (variance - n * wl * wl - 4.0 * n * wl - 3.0 * n) / (-4.0 * wl - 4.0);
+  const int num_lower = (int)lround(m);
+  for (int i = 0; i < n; i++) {
+    const int w = i < num_lower ? wl : wl + 2;
+    radius[i] = (w - 1) / 2;
+  }
+}
 
-  // The effective radius to consider when fetching pixels from memory for the
-  // filter sum.
-  int radius_x = img->width > dx ? dx : last_x;
-  int radius_y = img->height > dy ? dy : last_y;
+// Reciprocal of the width 2r+1 of a box filter, for gaussRound, in 32 bits
+// (so that the products vectorize), for r >= 1.
+static uint32_t gaussReciprocal(int r) {
+  return (uint32_t)llround(4294967296.0 / (2 * r + 1));
+}
 
-  // The filter window sizes and areas.
-  int win_width = 2 * dx + 1;
-  int win_height = 2 * dy + 1;
-  int win_area = win_width * win_height;
+// Round sum/(2r+1) to the nearest integer, given the reciprocal of 2r+1,
+// with an error of at most one in the last (fractional) bit, which is enough
+// here, for sums below 2^32.
+static inline uint16_t gaussRound(uint32_t sum, uint32_t reciprocal) {
+  return (uint16_t)(((uint64_t)sum * reciprocal + ((uint64_t)1 << 31)) >> 32);
+}
 
-  // The size of the filter window that exceeds the image size plus 1 for each
-  // axis.
-  int spill_x = dx >= img->width ? dx - radius_x + 1 : 1;
-  int spill_y = dy >= img->height ? dy - radius_y + 1 : 1;
+// Box filter of radius r on the columns of the width x height values of in,
+// clamped to the borders, into out, using sums (of width entries) for the
+// running sums of all the columns, so that the rows are read in order.
+static void gaussBoxColumns(uint16_t *out, const uint16_t *in, int width,
+                            int height, int r, uint32_t reciprocal,
+                            uint32_t *sums) {
+  if (r == 0) {
+    memcpy(out, in, (size_t)width * height * sizeof(uint16_t));
+    return;
+  }
+  const int last_y = height - 1;
+  const int inner = r < last_y ? r : last_y;
+  for (int x = 0; x < width; x++)
+    sums[x] = (uint32_t)(r + 1) * in[x];
+  for (int y = 1; y <= inner; y++) {
+    const uint16_t *row = in + (size_t)y * width;
+    for (int x = 0; x < width; x++)
+      sums[x] += row[x];
+  }
+  const uint16_t *last_row = in + (size_t)last_y * width;
+  for (int x = 0; x < width; x++)
+    sums[x] += (uint32_t)(r - inner) * last_row[x];
 
-  // Initialization phase
-  //
-  // This phase is responsible for initializing the sum vector that will be
-  // used throughout the algorithm. In here the sum of 1D filter in the y axis
-  // will be calculated for all pixels in the first line.
-  //
-  // The principle of accumulation can't be used here since we don't have a
-  // previous value so each pixel in the window will read and it's value added
-  // to the sum on the corresponding position.
-  for (int x = 0; x < img->width; x++) {
-    // The first pixel value will appear once in it's position but also y
-    // radius of the filter window times, because we are considering a border
-    // clamp sampling of the pixels, this means that all out of bounds pixel
-    // accesses will be mapped to the nearest pixel.
-    line_sum[x] = (dy + 1) * ImageGetPixel(img, x, 0);
+  for (int y = 0; y < height; y++) {
+    uint16_t *row_out = out + (size_t)y * width;
+    const uint16_t *next = in + (size_t)clamp(y + r + 1, 0, last_y) * width;
+    const uint16_t *prev = in + (size_t)clamp(y - r, 0, last_y) * width;
+    for (int x = 0; x < width; x++) {
+      row_out[x] = gaussRound(sums[x], reciprocal);
+      sums[x] += next[x] - prev[x];
+    }
+  }
+}
+
+/// Blur an image with an approximation of a Gaussian filter with standard
+/// deviation sigma (in pixels), with the pixels outside the image clamped to
+/// its border, as in ImageBlur.
+/// The filter is GAUSS_PASSES (3) box filters in a row, along the rows and
+/// along the columns, with widths chosen for the variance sigma^2, so the cost
+/// does not depend on sigma. The intermediate levels are kept in 16 bits, and
+/// only the final result is rounded to 8 bits.
+/// Requires: 0 <= sigma <= 10000.
+/// On success, returns nonzero.
+/// On failure, returns 0, the image is unchanged and errno/errCause are set
+/// accordingly.
+int ImageGaussianBlur(Image img, double sigma) { ///
+  assert(img != NULL);
+  assert(sigma >= 0.0 && sigma <= GAUSS_MAX_SIGMA);
+
+  const int width = img->width;
+  const int height = img->height;
+  if (ImageArea(img) == 0)
+    return 1;
+
+  int radius[GAUSS_PASSES];
+  uint32_t reciprocal[GAUSS_PASSES] = {0};
+  gaussBoxRadii(sigma, radius);
+  for (int i = 0; i < GAUSS_PASSES; i++) {
+    if (radius[i] > 0)
+      reciprocal[i] = gaussReciprocal(radius[i]);
+  }
+
+  // (a ping-pong pair of rasters, and of tiles with blocks of transposed
+  // rows, which stay in cache)
+  const size_t area = ImageArea(img);
+  const size_t tile_size = (size_t)width * GAUSS_ROW_BLOCK;
+  const int num_sums = width > GAUSS_ROW_BLOCK ? width : GAUSS_ROW_BLOCK;
+  uint16_t *values = (uint16_t *)malloc(area * sizeof(uint16_t));
+  uint16_t *temp = (uint16_t *)malloc(area * sizeof(uint16_t));
+  uint16_t *tile = (uint16_t *)malloc(2 * tile_size * sizeof(uint16_t));
+  uint32_t *sums = (uint32_t *)malloc(num_sums * sizeof(uint32_t));
+  if (!check(values != NULL && temp != NULL && tile != NULL && sums != NULL,
+             "Failed to allocate memory")) {
+    free(values);
+    free(temp);
+    free(tile);
+    free(sums);
+    return 0;
+  }
 
-    // Each of the pixels in the effective radius will be added to the sum we
-    // are calculating minus the last.
-    for (int half_win_y = 1; half_win_y < radius_y; half_win_y++) {
-      line_sum[x] += ImageGetPixel(img, x, half_win_y);
+  // All the passes along the rows, a block of rows at a time: the block is
+  // transposed into a tile, so that the running sums along its columns are
+  // updated for all the rows together (a single running sum along a row
+  // would be a chain of dependent additions). The tile always has
+  // GAUSS_ROW_BLOCK columns, so that the loops have a constant size, and
+  // those past the last row are just not copied back.
+  const uint8 *rows[GAUSS_ROW_BLOCK];
+  for (int y_begin = 0; y_begin < height; y_begin += GAUSS_ROW_BLOCK) {
+    const int num_rows = height - y_begin < GAUSS_ROW_BLOCK ? height - y_begin
+                                                            : GAUSS_ROW_BLOCK;
+    for (int j = 0; j < GAUSS_ROW_BLOCK; j++)
+      rows[j] = img->pixel + G(img, 0, y_begin + (j < num_rows ? j : 0));
+    uint16_t *in = tile;
+    uint16_t *out = tile + tile_size;
+    for (int x = 0; x < width; x++) {
+      for (int j = 0; j < GAUSS_ROW_BLOCK; j++)
+        in[(size_t)x * GAUSS_ROW_BLOCK + j] =
+            (uint16_t)(rows[j][x] << GAUSS_FRACTION_BITS);
+    }
+    for (int i = 0; i < GAUSS_PASSES; i++) {
+      gaussBoxColumns(out, in, GAUSS_ROW_BLOCK, width, radius[i],
+                      reciprocal[i], sums);
+      uint16_t *t = in;
+      in = out;
+      out = t;
+    }
+    for (int j = 0; j < num_rows; j++) {
+      uint16_t *row = values + (size_t)(y_begin + j) * width;
+      for (int x = 0; x < width; x++)
+        row[x] = in[(size_t)x * GAUSS_ROW_BLOCK + j];
     }
+  }
 
-    // The last pixel will, like the first pixel, not only appear once but also
-    // as many times as the filter window exceeds the image size.
-    line_sum[x] += spill_y * ImageGetPixel(img, x, radius_y);
+  // Then all the passes along the columns
+  uint16_t *in = values;
+  uint16_t *out = temp;
+  for (int i = 0; i < GAUSS_PASSES; i++) {
+    gaussBoxColumns(out, in, width, height, radius[i], reciprocal[i], sums);
+    uint16_t *t = in;
+    in = out;
+    out = t;
   }
 
-  // From this point on each line will be treated individually to calculate it's
-  // blurred values.
-  for (int y = 0; y < img->height; y++) {
-    // NOTE: This part could be made more efficient (in run time, not number of
-    // operations), by performing all other operations except this if for the
-    // first line, having this loop start at 1 and then removing the if.
-    //
-    // This would remove a conditional from the hot code path, but increase the
-    // code size of the function.
-    if (y != 0) {
-      // Update phase
-      //
-      // For all lines, except the first, the sum vector will need to be updated
-      // with the new pixels value. But as we already have a previous sum for
-      // the last line, we don't need to consider all pixels instead we only
-      // subtract the first pixel of the previous window and add the last pixel
-      // of the current window.
+  const uint16_t half = 1 << (GAUSS_FRACTION_BITS - 1);
+  for (size_t i = 0; i < area; i++)
+    img->pixel[i] = (uint8)((in[i] + half) >> GAUSS_FRACTION_BITS);
+  // count a read and a write for each pixel
+  COUNT(PIXMEM, 2 * area);
+  COUNT(DIVISIONS, 2 * GAUSS_PASSES * area);
 
-      // The read coordinates need to be clamped to the image size.
+  free(values);
+  free(temp);
+  free(tile);
+  free(sums);
+  return 1;
+}
+
+// Separable convolution.
+// The kernel is the product of a 1D kernel kx along the rows and a 1D kernel
+// ky along the columns, with odd lengths, centered on the pixel. Each row is
+// first convolved with kx into a ring with the last rows still needed (as in
+// ImageBlurInPlace), and then the rows of the ring are combined with ky into
+// each output row, so the image is convolved in place.
+// The 3- and 5-tap kernels, the most common ones, are done by functions with
+// the number of taps fixed at compile time, so that the loops over the taps
+// are unrolled and those over the pixels are vectorized.
+
+// Division of the convolution sums by the divisor, rounded to the nearest
+// integer (halves up), which may be negative. As for blurDivisor, the rounded
+// quotient is floor(n / (2 * divisor)), for n = 2 * sum + divisor, which is
+// made non-negative by adding bias * divisor to the sum (and subtracting
+// bias from the quotient), and then done with a multiplication and a shift,
+// when n < 2^31 for all sums, or with a division otherwise.
+struct convDivisor {
+  int64_t divisor;
+  int64_t bias;
+  int shift;
+  uint64_t mul;
+};
+
+static void convDivisorInit(struct convDivisor *div, int divisor,
+                            int64_t min_sum, int64_t max_sum) {
+  div->divisor = divisor;
+  div->bias = min_sum < 0 ? (-min_sum + divisor - 1) / divisor : 0;
+  div->shift = 0;
+  div->mul = 0;
+  const uint64_t d = 2 * (uint64_t)divisor;
+  if (2 * (max_sum + div->bias * divisor) + divisor < ((int64_t)1 << 31)) {
+    int log2_d = 0;
+    while (((uint64_t)1 << log2_d) < d)
+      log2_d++;
+    div->shift = 31 + log2_d;
+    div->mul = (((uint64_t)1 << div->shift) + d - 1) / d;
+  }
+}
+
+// Divide the width sums by the divisor, add offset and saturate the results
+// to [0, maxval], into out.
+// With the multiplication, n < 2^31 and mul < 2^32, so n and mul are taken
+// as 32-bit values (with wrap around, since n is right modulo 2^32), and
+// shift >= 32.
+static void convDivideRow(uint8 *out, const int *sums, int width,
+                          const struct convDivisor *div, int offset,
+                          int maxval) {
+  const int64_t bias = div->bias;
+  const int64_t n_offset = 2 * bias * div->divisor + div->divisor;
+  if (div->mul != 0) {
+    const uint32_t n_offset32 = (uint32_t)n_offset;
+    const uint32_t mul = (uint32_t)div->mul;
+    const int shift = div->shift;
+    int x = 0;
+#ifdef __SSE2__
+    // 16 pixels at a time: the quotients, minus bias, are saturated to 16
+    // bits, which does not change the result of adding an offset of up to
+    // 32767 - PixMax and saturating to [0, maxval], and then to 8 bits.
+    if (-32767 + PixMax <= offset && offset <= 32767 - PixMax) {
+      const __m128i vn_offset = _mm_set1_epi32((int)n_offset32);
+      const __m128i vmul = _mm_set1_epi32((int)mul);
+      const __m128i vshift = _mm_cvtsi32_si128(shift);
+      const __m128i vbias = _mm_set1_epi32((int)bias);
+      const __m128i voffset = _mm_set1_epi16((short)offset);
+      const __m128i vmaxval = _mm_set1_epi8((char)maxval);
+      __m128i quotient[4];
+      for (; x + 16 <= width; x += 16) {
+        for (int i = 0; i < 4; i++) {
+          const __m128i sum =
+              _mm_loadu_si128((const __m128i *)(sums + x + 4 * i));
+          const __m128i n = _mm_add_epi32(_mm_add_epi32(sum, sum), vn_offset);
+          // (the products of the even and the odd lanes)
+          const __m128i even = _mm_srl_epi64(_mm_mul_epu32(n, vmul), vshift);
+          const __m128i odd = _mm_srl_epi64(
+              _mm_mul_epu32(_mm_srli_epi64(n, 32), vmul), vshift);
+          quotient[i] = _mm_sub_epi32(
+              _mm_or_si128(even, _mm_slli_epi64(odd, 32)), vbias);
+        }
+        const __m128i lo =
+            _mm_adds_epi16(_mm_packs_epi32(quotient[0], quotient[1]), voffset);
+        const __m128i hi =
+            _mm_adds_epi16(_mm_packs_epi32(quotient[2], quotient[3]), voffset);
+        _mm_storeu_si128((__m128i *)(out + x),
+                         _mm_min_epu8(_mm_packus_epi16(lo, hi), vmaxval));
+      }
+    }
+#endif
+    for (; x < width; x++) {
+      const uint32_t n = 2 * (uint32_t)sums[x] + n_offset32;
+      const int64_t q = (int64_t)(((uint64_t)n * mul) >> shift) - bias + offset;
+      out[x] = (uint8)(q < 0 ? 0 : q > maxval ? maxval : q);
+    }
+  } else {
+    const uint64_t d = 2 * (uint64_t)div->divisor;
+    for (int x = 0; x < width; x++) {
+      const uint64_t n = (uint64_t)(2 * (int64_t)sums[x] + n_offset);
+      const int64_t q = (int64_t)(n / d) - bias + offset;
+      out[x] = (uint8)(q < 0 ? 0 : q > maxval ? maxval : q);
+    }
+  }
+}
+
+// Convolve the padded line in (with the n-1 clamped values around the width
+// values of the line) with kernel k of n taps, into out.
+typedef void (*convRowFn)(int *out, const int *in, int width, const int *k,
+                          int n);
+
+// Combine rows[0..n-1] with kernel k of n taps, into out.
+typedef void (*convColumnFn)(int *out, const int *const *rows, int width,
+                             const int *k, int n);
+
+static void convRow(int *out, const int *in, int width, const int *k, int n) {
+  // (one tap at a time, over the whole line, which vectorizes)
+  for (int x = 0; x < width; x++)
+    out[x] = k[0] * in[x];
+  for (int i = 1; i < n; i++) {
+    for (int x = 0; x < width; x++)
+      out[x] += k[i] * in[x + i];
+  }
+}
+
+static void convColumn(int *out, const int *const *rows, int width,
+                       const int *k, int n) {
+  for (int x = 0; x < width; x++)
+    out[x] = k[0] * rows[0][x];
+  for (int j = 1; j < n; j++) {
+    const int *row = rows[j];
+    for (int x = 0; x < width; x++)
+      out[x] += k[j] * row[x];
+  }
+}
+
+// Specialized passes for kernels of N taps.
+#define CONV_KERNEL(N)                                                         \
+  static void convRow##N(int *out, const int *in, int width, const int *k,     \
+                         int n) {                                              \
+    assert(n == N);                                                            \
+    (void)n;                                                                   \
+    int taps[N];                                                               \
+    for (int i = 0; i < N; i++)                                                \
+      taps[i] = k[i];                                                          \
+    for (int x = 0; x < width; x++) {                                          \
+      int sum = 0;                                                             \
+      for (int i = 0; i < N; i++)                                              \
+        sum += taps[i] * in[x + i];                                            \
+      out[x] = sum;                                                            \
+    }                                                                          \
+  }                                                                            \
+                                                                               \
+  static void convColumn##N(int *out, const int *const *rows, int width,      \
+                            const int *k, int n) {                             \
+    assert(n == N);                                                            \
+    (void)n;                                                                   \
+    int taps[N];                                                               \
+    const int *r[N];                                                           \
+    for (int j = 0; j < N; j++) {                                              \
+      taps[j] = k[j];                                                          \
+      r[j] = rows[j];                                                          \
+    }                                                                          \
+    for (int x = 0; x < width; x++) {                                          \
+      int sum = 0;                                                             \
+      for (int j = 0; j < N; j++)                                              \
+        sum += taps[j] * r[j][x];                                              \
+      out[x] = sum;                                                            \
+    }                                                                          \
+  }
+
+CONV_KERNEL(3)
+CONV_KERNEL(5)
+
+static convRowFn convRowFor(int n) {
+  return n == 3 ? convRow3 : n == 5 ? convRow5 : convRow;
+}
+
+static convColumnFn convColumnFor(int n) {
+  return n == 3 ? convColumn3 : n == 5 ? convColumn5 : convColumn;
+}
+
+// Range [*min_sum, *max_sum] of the convolution with kernel k of n taps of
+// values in the range [min_in, max_in].
+static void convRange(const int *k, int n, int64_t min_in, int64_t max_in,
+                      int64_t *min_sum, int64_t *max_sum) {
+  *min_sum = 0;
+  *max_sum = 0;
+  for (int i = 0; i < n; i++) {
+    *min_sum += k[i] * (k[i] < 0 ? max_in : min_in);
+    *max_sum += k[i] * (k[i] < 0 ? min_in : max_in);
+  }
+}
+
+// Sum of the absolute values of the n taps of kernel k.
+static int64_t convWeight(const int *k, int n) {
+  int64_t weight = 0;
+  for (int i = 0; i < n; i++)
+    weight += k[i] < 0 ? -(int64_t)k[i] : k[i];
+  return weight;
+}
+
+// Convolve row y of img with kernel kx of nx taps, with the row_pass
+// function, into out, using padded (of width+nx-1 entries) for the row
+// clamped to its borders.
+static void convImageRow(Image img, int y, int *padded, int *out,
+                         const int *kx, int nx, convRowFn row_pass) {
+  const int width = img->width;
+  const int rx = nx / 2;
+  const uint8 *row = img->pixel + G(img, 0, y);
+  for (int i = 0; i < rx; i++) {
+    padded[i] = row[0];
+    padded[rx + width + i] = row[width - 1];
+  }
+  for (int x = 0; x < width; x++)
+    padded[rx + x] = row[x];
+  row_pass(out, padded, width, kx, nx);
+}
+
+/// Convolve an image with a separable integer kernel: the product of kernel
+/// kx (of nx taps) along the rows and kernel ky (of ny taps) along the
+/// columns, both centered on the pixel, with the pixels outside the image
+/// clamped to its border, as in ImageBlur.
+/// Each pixel is substituted by its convolution sum divided by divisor,
+/// rounded to the nearest integer, plus offset, saturated to [0, maxval].
+/// (For example, kx = {-1, 0, 1}, ky = {1, 2, 1}, divisor 8 and offset 128
+/// give the horizontal Sobel derivative, and kx = ky = {1, 1, 1} with divisor
+/// 9 gives ImageBlur(img, 1, 1).)
+/// Requires: nx and ny must be odd and positive, divisor > 0, and
+/// PixMax * (sum of |kx|) * (sum of |ky|) must fit in an int.
+/// On success, returns nonzero.
+/// On failure, returns 0, the image is unchanged and errno/errCause are set
+/// accordingly.
+int ImageConvolve(Image img, const int *kx, int nx, const int *ky, int ny,
+                  int divisor, int offset) { ///
+  assert(img != NULL);
+  assert(kx != NULL && nx > 0 && nx % 2 == 1);
+  assert(ky != NULL && ny > 0 && ny % 2 == 1);
+  assert(divisor > 0);
+
+  // (this bounds all the partial sums as well)
+  assert(PixMax * convWeight(kx, nx) * convWeight(ky, ny) <= INT_MAX);
+
+  int64_t row_min, row_max, min_sum, max_sum;
+  convRange(kx, nx, 0, PixMax, &row_min, &row_max);
+  convRange(ky, ny, row_min, row_max, &min_sum, &max_sum);
+
+  const int width = img->width;
+  const int height = img->height;
+  if (ImageArea(img) == 0)
+    return 1;
+
+  const int ry = ny / 2;
+  const int ring_rows = ny < height ? ny : height;
+  int *padded = (int *)malloc(((size_t)width + nx - 1) * sizeof(int));
+  int *ring = (int *)malloc((size_t)ring_rows * width * sizeof(int));
+  int *sums = (int *)malloc(width * sizeof(int));
+  const int **rows = (const int **)malloc(ny * sizeof(int *));
+  if (!check(padded != NULL && ring != NULL && sums != NULL && rows != NULL,
+             "Failed to allocate memory")) {
+    free(padded);
+    free(ring);
+    free(sums);
+    free(rows);
+    return 0;
+  }
+
+  const convRowFn row_pass = convRowFor(nx);
+  const convColumnFn column_pass = convColumnFor(ny);
+  struct convDivisor div;
+  convDivisorInit(&div, divisor, min_sum, max_sum);
+  const int last_y = height - 1;
+  const int maxval = img->maxval;
+
+  // Row r is convolved with kx into slot r % ring_rows of the ring.
+  // Row y is overwritten after the rows up to y+ry are in the ring, where
+  // they replace the rows above y-ry, which are no longer needed.
+  int next_y = 0;
+  for (int y = 0; y < height; y++) {
+    for (; next_y <= y + ry && next_y < height; next_y++) {
+      convImageRow(img, next_y, padded,
+                   ring + (size_t)(next_y % ring_rows) * width, kx, nx,
+                   row_pass);
+    }
+    for (int j = 0; j < ny; j++) {
+      const int src_y = clamp(y - ry + j, 0, last_y);
+      rows[j] = ring + (size_t)(src_y % ring_rows) * width;
+    }
+    column_pass(sums, rows, width, ky, ny);
+
+    convDivideRow(img->pixel + G(img, 0, y), sums, width, &div, offset,
+                  maxval);
+  }
+  // count a read and a write for each pixel
+  COUNT(PIXMEM, 2 * ImageArea(img));
+  COUNT(DIVISIONS, ImageArea(img));
+
+  free(padded);
+  free(ring);
+  free(sums);
+  free(rows);
+  return 1;
+}
+
+// Median filter, in constant time per pixel (Perreault and Hebert).
+// As in ImageBlur, there is a running state for each column, a histogram of
+// the levels of the (2dy+1) pixels of the column in the window, which is
+// updated for each row by removing the pixel leaving the window and adding
+// the one entering it. The histogram of the window is then updated for each
+// pixel along the row by removing the histogram of the column leaving it and
+// adding that of the column entering it, and the median is found from it.
+// The histograms have two levels, a coarse one with COARSE_BINS bins of 16
+// levels each and a fine one with the 256 levels, so that only the coarse
+// histograms are updated for every pixel, and the median is found by
+// scanning the coarse histogram of the window and then the 16 fine bins of a
+// single coarse bin. The fine histogram of the window is kept for each coarse
+// bin separately, and only brought up to date for the pixel when that coarse
+// bin has the median.
+// The image is split in column strips, each with the column histograms of
+// its columns and dx columns on each side, so that they fit in cache, and
+// the strips can be filtered in parallel.
+#define COARSE_BINS 16
+#define FINE_BINS 16 // fine bins for each coarse bin
+#define MEDIAN_PARALLEL_MIN (1 << 16)
+#define MEDIAN_STRIP_WIDTH 512
+
+// Width of the column strips for filtering an image of the given width with
+// x radius dx by the given number of workers: at least 4dx wide, to keep the
+// overhead of the extra columns small, and enough strips for the workers.
+static int medianStripWidth(int width, int dx, int workers) {
+  int strip = MEDIAN_STRIP_WIDTH > 4 * dx ? MEDIAN_STRIP_WIDTH : 4 * dx;
+  const int share = (width + workers - 1) / workers;
+  if (strip > share)
+    strip = share;
+  return strip < width ? strip : width;
+}
+
+// Add count times the pixel of level to the column histogram.
+static inline void medianColumnAdd(uint16_t *coarse, uint16_t *fine,
+                                   uint8 level, int count) {
+  coarse[level / FINE_BINS] += count;
+  fine[level] += count;
+}
+
+// Add count times the num_columns pixels of row to the column histograms.
+static void medianRowAdd(uint16_t *col_coarse, uint16_t *col_fine,
+                         const uint8 *row, int num_columns, int count) {
+  for (int c = 0; c < num_columns; c++) {
+    medianColumnAdd(col_coarse + (size_t)c * COARSE_BINS,
+                    col_fine + (size_t)c * COARSE_BINS * FINE_BINS, row[c],
+                    count);
+  }
+}
+
+// Median filter the pixels of the rows of img in the column strip
+// [x_begin, x_end[, writing them into out, given the memory for the column
+// histograms of the (x_end - x_begin + 2dx) columns of the strip.
+// Returns the number of pixels read.
+// This is an internal function, used by ImageMedian, which counts the pixel
+// accesses, since it may run on multiple threads.
+static unsigned long medianStrip(Image img, uint8 *out, uint16_t *col_coarse,
+                                 uint16_t *col_fine, int dx, int dy,
+                                 int x_begin, int x_end) {
+  const int width = img->width;
+  const int height = img->height;
+  const int last_x = width - 1;
+  const int last_y = height - 1;
+  const int c_begin = x_begin - dx > 0 ? x_begin - dx : 0;
+  const int c_end = x_end + dx < width ? x_end + dx : width;
+  const int num_columns = c_end - c_begin;
+  const uint32_t rank = (uint32_t)(2 * dx + 1) * (2 * dy + 1) / 2;
+  unsigned long pixmem = 0;
+
+  // Initialization of the column histograms, with the rows of the window of
+  // row 0, where those above are row 0, and those below the last row
+  memset(col_coarse, 0, (size_t)num_columns * COARSE_BINS * sizeof(uint16_t));
+  memset(col_fine, 0,
+         (size_t)num_columns * COARSE_BINS * FINE_BINS * sizeof(uint16_t));
+  // (a row at a time, to read the pixels in order)
+  const int inner = dy < last_y ? dy : last_y;
+  medianRowAdd(col_coarse, col_fine, img->pixel + G(img, c_begin, 0),
+               num_columns, dy + 1);
+  for (int y = 1; y <= inner; y++) {
+    medianRowAdd(col_coarse, col_fine, img->pixel + G(img, c_begin, y),
+                 num_columns, 1);
+  }
+  if (dy > inner) {
+    medianRowAdd(col_coarse, col_fine, img->pixel + G(img, c_begin, last_y),
+                 num_columns, dy - inner);
+  }
+  pixmem += (unsigned long)num_columns * (inner + 1 + (dy > inner));
+
+  uint32_t coarse[COARSE_BINS];
+  uint32_t fine[COARSE_BINS * FINE_BINS];
+  int fine_x[COARSE_BINS]; // the pixel where each coarse bin of fine was
+                           // brought up to date
+  for (int y = 0; y < height; y++) {
+    if (y != 0) {
+      // Update the column histograms
       const int prev_y = clamp(y - dy - 1, 0, last_y);
       const int next_y = clamp(y + dy, 0, last_y);
+      medianRowAdd(col_coarse, col_fine, img->pixel + G(img, c_begin, prev_y),
+                   num_columns, -1);
+      medianRowAdd(col_coarse, col_fine, img->pixel + G(img, c_begin, next_y),
+                   num_columns, 1);
+      pixmem += 2 * (unsigned long)num_columns;
+    }
 
-      for (int x = 0; x < img->width; x++) {
-        line_sum[x] +=
-            ImageGetPixel(img, x, next_y) - ImageGetPixel(img, x, prev_y);
-      }
+    // The coarse histogram of the window of the first pixel, with the
+    // columns to the left of the image being column 0, and those to the
+    // right the last column; the fine one is brought up to date when needed
+    memset(coarse, 0, sizeof(coarse));
+    for (int c = x_begin - dx; c <= x_begin + dx; c++) {
+      const uint16_t *column =
+          col_coarse + (size_t)(clamp(c, 0, last_x) - c_begin) * COARSE_BINS;
+      for (int b = 0; b < COARSE_BINS; b++)
+        coarse[b] += column[b];
     }
+    // (as if brought up to date too far back to be updated)
+    for (int b = 0; b < COARSE_BINS; b++)
+      fine_x[b] = x_begin - 2 * dx - 2;
 
-    // Blur phase
-    //
-    // Finally the blurred pixel value will be calculated, this is done by first
-    // calculating the sum for the first pixel (by summing the values of
-    // vertical filter inside the horizontal filter window), this will be used
-    // not only for the blurred value of the first pixel but also for
-    // accumulation on subsequent pixels.
+    uint8 *row_out = out + G(img, 0, y);
+    for (int x = x_begin; x < x_end; x++) {
+      if (x != x_begin) {
+        // (unsigned arithmetic wraps around, so the counts stay right)
+        const int add_c = clamp(x + dx, 0, last_x) - c_begin;
+        const int sub_c = clamp(x - dx - 1, 0, last_x) - c_begin;
+        const uint16_t *add = col_coarse + (size_t)add_c * COARSE_BINS;
+        const uint16_t *sub = col_coarse + (size_t)sub_c * COARSE_BINS;
+        for (int b = 0; b < COARSE_BINS; b++)
+          coarse[b] += add[b] - sub[b];
+      }
 
-    // Here, as when calculating the initial values for the sum vector, we
-    // multiply the first and last pixel values for the part of the filter
-    // window that is out of bounds instead of making multiple clamped reads.
-    // All pixels in the effective memory region are read normally and their
-    // value added to the sum.
-    int sum = (dx + 1) * line_sum[0];
-    for (int half_win_x = 1; half_win_x < radius_x; half_win_x++) {
-      sum += line_sum[half_win_x];
+      // The coarse bin with the median
+      uint32_t below = 0;
+      int b = 0;
+      while (below + coarse[b] <= rank) {
+        below += coarse[b];
+        b++;
+      }
+
+      // Bring its fine bins up to date, by updating them for each pixel
+      // since they were, or from the columns of the window, if it is nearer
+      uint32_t *bin_fine = fine + b * FINE_BINS;
+      if (x - fine_x[b] <= 2 * dx + 1) {
+        for (int ux = fine_x[b] + 1; ux <= x; ux++) {
+          const int add_c = clamp(ux + dx, 0, last_x) - c_begin;
+          const int sub_c = clamp(ux - dx - 1, 0, last_x) - c_begin;
+          const uint16_t *add =
+              col_fine + ((size_t)add_c * COARSE_BINS + b) * FINE_BINS;
+          const uint16_t *sub =
+              col_fine + ((size_t)sub_c * COARSE_BINS + b) * FINE_BINS;
+          for (int i = 0; i < FINE_BINS; i++)
+            bin_fine[i] += add[i] - sub[i];
+        }
+      } else {
+        memset(bin_fine, 0, FINE_BINS * sizeof(uint32_t));
+        for (int c = x - dx; c <= x + dx; c++) {
+          const int column_c = clamp(c, 0, last_x) - c_begin;
+          const uint16_t *column =
+              col_fine + ((size_t)column_c * COARSE_BINS + b) * FINE_BINS;
+          for (int i = 0; i < FINE_BINS; i++)
+            bin_fine[i] += column[i];
+        }
+      }
+      fine_x[b] = x;
+
+      // The fine bin with the median: the number of bins whose cumulative
+      // count is not above the rank (without branches, which are hard to
+      // predict here)
+      int i = 0;
+      uint32_t cumulative = below;
+      for (int j = 0; j < FINE_BINS - 1; j++) {
+        cumulative += bin_fine[j];
+        i += cumulative <= rank;
+      }
+      row_out[x] = (uint8)(b * FINE_BINS + i);
     }
-    sum += spill_x * line_sum[radius_x];
+  }
+  return pixmem;
+}
+
+struct medianJob {
+  Image img;
+  uint8 *out;
+  int dx;
+  int dy;
+  int strip;               // number of columns in each strip
+  size_t columns;          // number of column histograms for each strip
+  uint16_t *col_coarse;    // coarse column histograms for each thread
+  uint16_t *col_fine;      // fine column histograms for each thread
+  atomic_int next_strip;   // index of the next strip to filter
+  atomic_int next_buffer;  // index of the next unused histograms
+  atomic_ulong pixmem;     // pixel reads, added by each thread at the end
+};
+
+// Median filter column strips until there are none left.
+static void *medianWorker(void *arg) {
+  struct medianJob *job = (struct medianJob *)arg;
+  const Image img = job->img;
+  const size_t buffer = atomic_fetch_add(&job->next_buffer, 1);
+  uint16_t *col_coarse = job->col_coarse + buffer * job->columns * COARSE_BINS;
+  uint16_t *col_fine =
+      job->col_fine + buffer * job->columns * COARSE_BINS * FINE_BINS;
+  unsigned long pixmem = 0;
+
+  for (;;) {
+    const int x_begin = atomic_fetch_add(&job->next_strip, 1) * job->strip;
+    if (x_begin >= img->width)
+      break;
+    const int x_end = img->width - x_begin < job->strip ? img->width
+                                                        : x_begin + job->strip;
+    pixmem += medianStrip(img, job->out, col_coarse, col_fine, job->dx,
+                          job->dy, x_begin, x_end);
+  }
+
+  atomic_fetch_add(&job->pixmem, pixmem);
+  return NULL;
+}
+
+/// Apply a (2dx+1)x(2dy+1) median filter to an image.
+/// Each pixel is substituted by the median of the pixels in the rectangle
+/// [x-dx, x+dx]x[y-dy, y+dy], with the pixels outside the image clamped to
+/// its border, as in ImageBlur.
+/// The cost per pixel does not depend on the radii (see medianStrip).
+/// Large images are filtered by as many threads as set by ImageSetThreads,
+/// each doing strips of columns, with the same result.
+/// Requires: 0 <= dx, dy <= 32767.
+/// On success, returns nonzero.
+/// On failure, returns 0, the image is unchanged and errno/errCause are set
+/// accordingly.
+int ImageMedian(Image img, int dx, int dy) { ///
+  assert(img != NULL);
+  assert(0 <= dx && dx <= 32767);
+  assert(0 <= dy && dy <= 32767);
+
+  const size_t num_pixels = ImageArea(img);
+  if (num_pixels == 0)
+    return 1;
+
+  int workers = threadCount();
+  if (num_pixels < MEDIAN_PARALLEL_MIN)
+    workers = 1;
+
+  struct medianJob job;
+  job.strip = medianStripWidth(img->width, dx, workers);
+  const int num_strips = (img->width + job.strip - 1) / job.strip;
+  if (workers > num_strips)
+    workers = num_strips;
+  job.columns = job.strip + 2 * dx < img->width ? job.strip + 2 * dx
+                                                : img->width;
+
+  // Column histograms for each thread, or for a single one if there is not
+  // enough memory for them
+  uint8 *filtered_pixels = (uint8 *)malloc(num_pixels * sizeof(uint8));
+  for (;; workers = 1) {
+    const size_t histograms = (size_t)workers * job.columns * COARSE_BINS;
+    job.col_coarse = (uint16_t *)malloc(histograms * sizeof(uint16_t));
+    job.col_fine =
+        (uint16_t *)malloc(histograms * FINE_BINS * sizeof(uint16_t));
+    if ((job.col_coarse != NULL && job.col_fine != NULL) || workers == 1)
+      break;
+    free(job.col_coarse);
+    free(job.col_fine);
+  }
+  if (!check(filtered_pixels != NULL && job.col_coarse != NULL &&
+                 job.col_fine != NULL,
+             "Failed to allocate memory")) {
+    free(filtered_pixels);
+    free(job.col_coarse);
+    free(job.col_fine);
+    return 0;
+  }
+
+  job.img = img;
+  job.out = filtered_pixels;
+  job.dx = dx;
+  job.dy = dy;
+  atomic_init(&job.next_strip, 0);
+  atomic_init(&job.next_buffer, 0);
+  atomic_init(&job.pixmem, 0);
+  runWorkers(medianWorker, &job, workers);
+  COUNT(PIXMEM, atomic_load(&job.pixmem) + num_pixels); // and a write each
+
+  free(job.col_coarse);
+  free(job.col_fine);
+  ImageReleasePixels(img);
+  img->pixel = filtered_pixels;
+  return 1;
+}
+
+/// Streaming
+
+/// These functions process PGM files a strip of rows at a time, so that
+/// images larger than the available memory can be processed.
+
+// Internal structure of a PGM file being read a strip at a time
+struct imageReader {
+  FILE *f;
+  int width;
+  int height;
+  int maxval;
+  int next_row; // index of the next row to be read
+};
+
+// Internal structure of a PGM file being written a strip at a time
+struct imageWriter {
+  FILE *f;
+  int width;
+  int height;
+  int next_row; // index of the next row to be written
+};
+
+/// Open a raw PGM file for reading it a strip of rows at a time.
+/// Only 8 bit PGM files are accepted.
+/// On success, a new reader is returned.
+/// (The caller is responsible for closing the returned reader!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+ImageReader ImageReaderOpen(const char *filename) { ///
+  uint8 block[LOAD_BLOCK_SIZE];
+  size_t len = 0;
+  size_t offset;
+  FILE *f = NULL;
+  ImageReader reader = NULL;
+
+  int success =
+      check((f = fopen(filename, "rb")) != NULL, "Open failed") &&
+      check((len = fread(block, sizeof(uint8), sizeof(block), f)) > 0,
+            "Invalid file format") &&
+      check((reader = (ImageReader)malloc(sizeof(struct imageReader))) !=
+                NULL,
+            "Failed to allocate reader") &&
+      // Parse PGM header and position the file at the first pixel
+      parseHeader(block, len, &reader->width, &reader->height,
+                  &reader->maxval, &offset) &&
+      check(fseek(f, (long)offset, SEEK_SET) == 0, "Reading pixels");
+
+  if (!success) {
+    errsave = errno;
+    free(reader);
+    if (f != NULL)
+      fclose(f);
+    errno = errsave;
+    return NULL;
+  }
+
+  reader->f = f;
+  reader->next_row = 0;
+  return reader;
+}
+
+/// Close the reader pointed to by (*readerp).
+/// If (*readerp)==NULL, no operation is performed.
+/// Ensures: (*readerp)==NULL.
+void ImageReaderClose(ImageReader *readerp) { ///
+  assert(readerp != NULL);
+
+  if (*readerp == NULL)
+    return;
+
+  fclose((*readerp)->f);
+  free(*readerp);
+  *readerp = NULL;
+}
+
+/// Get the width of the image being read
+int ImageReaderWidth(ImageReader reader) { ///
+  assert(reader != NULL);
+  return reader->width;
+}
+
+/// Get the height of the image being read
+int ImageReaderHeight(ImageReader reader) { ///
+  assert(reader != NULL);
+  return reader->height;
+}
+
+/// Get the maximum gray level of the image being read
+int ImageReaderMaxval(ImageReader reader) { ///
+  assert(reader != NULL);
+  return reader->maxval;
+}
+
+// Read the next rows of the image being read into pixel.
+// Reads up to rows rows (less if the end of the image is reached).
+// On success, returns the number of rows read.
+// On failure, returns -1 and errno/errCause are set accordingly.
+static int readRows(ImageReader reader, uint8 *pixel, int rows) {
+  const int remaining = reader->height - reader->next_row;
+  if (rows > remaining)
+    rows = remaining;
+
+  const size_t num_pixels = (size_t)rows * reader->width;
+  if (!check(fread(pixel, sizeof(uint8), num_pixels, reader->f) == num_pixels,
+             "Reading pixels"))
+    return -1;
+  COUNT(PIXMEM, num_pixels); // count pixel memory accesses
+
+  reader->next_row += rows;
+  return rows;
+}
+
+/// Read the next strip of rows.
+/// Reads the next ImageHeight(strip) rows (or less, if the end of the image
+/// is reached) into strip, and sets the strip height to the number of rows
+/// read.
+/// Requires: the strip width must be the same as the reader's.
+/// On success, returns the number of rows read (0 at the end of the image).
+/// On failure, returns -1 and errno/errCause are set accordingly.
+int ImageReaderRead(ImageReader reader, Image strip) { ///
+  assert(reader != NULL);
+  assert(strip != NULL);
+  assert(strip->width == reader->width);
+
+  const int rows = readRows(reader, strip->pixel, strip->height);
+  if (rows >= 0)
+    strip->height = rows;
+  return rows;
+}
+
+/// Create a raw PGM file for writing it a strip of rows at a time.
+///   width, height : the dimensions of the image.
+///   maxval: the maximum gray level (corresponding to white).
+/// Requires: width and height must be non-negative, maxval > 0.
+/// On success, a new writer is returned.
+/// (The caller is responsible for closing the returned writer!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+ImageWriter ImageWriterOpen(const char *filename, int width, int height,
+                            uint8 maxval) { ///
+  assert(width >= 0);
+  assert(height >= 0);
+  assert(0 < maxval && maxval <= PixMax);
+  FILE *f = NULL;
+  ImageWriter writer = NULL;
+
+  int success =
+      check((f = fopen(filename, "wb")) != NULL, "Open failed") &&
+      check(fprintf(f, "P5\n%d %d\n%u\n", width, height, maxval) > 0,
+            "Writing header failed") &&
+      check((writer = (ImageWriter)malloc(sizeof(struct imageWriter))) !=
+                NULL,
+            "Failed to allocate writer");
+
+  if (!success) {
+    errsave = errno;
+    if (f != NULL)
+      fclose(f);
+    errno = errsave;
+    return NULL;
+  }
+
+  writer->f = f;
+  writer->width = width;
+  writer->height = height;
+  writer->next_row = 0;
+  return writer;
+}
+
+// Append rows rows stored in pixel to the image being written.
+// On success, returns nonzero.
+// On failure, returns 0 and errno/errCause are set accordingly.
+static int writeRows(ImageWriter writer, const uint8 *pixel, int rows) {
+  assert(rows <= writer->height - writer->next_row);
+
+  const size_t num_pixels = (size_t)rows * writer->width;
+  if (!check(fwrite(pixel, sizeof(uint8), num_pixels, writer->f) ==
+                 num_pixels,
+             "Writing pixels failed"))
+    return 0;
+  COUNT(PIXMEM, num_pixels); // count pixel memory accesses
+
+  writer->next_row += rows;
+  return 1;
+}
+
+/// Write a strip of rows.
+/// Appends all rows of strip to the image being written.
+/// Requires: the strip width must be the same as the writer's, and the strip
+/// must not exceed the remaining rows.
+/// On success, returns nonzero.
+/// On failure, returns 0 and errno/errCause are set accordingly.
+int ImageWriterWrite(ImageWriter writer, Image strip) { ///
+  assert(writer != NULL);
+  assert(strip != NULL);
+  assert(strip->width == writer->width);
+
+  return writeRows(writer, strip->pixel, strip->height);
+}
 
-    // Calculate the blurred value by dividing the sum by the window area and
-    // store it in the blurred pixels memory.
-    PIXMEM++; // count one pixel access (write)
-    blurred_pixels[G(img, 0, y)] = round_div(sum, win_area);
+/// Close the writer pointed to by (*writerp).
+/// If (*writerp)==NULL, no operation is performed.
+/// Ensures: (*writerp)==NULL.
+/// On success, returns nonzero.
+/// On failure (including not all rows being written), returns 0,
+/// errno/errCause are set appropriately, and a partial and invalid file may
+/// be left in the system.
+int ImageWriterClose(ImageWriter *writerp) { ///
+  assert(writerp != NULL);
+
+  ImageWriter writer = *writerp;
+  if (writer == NULL)
+    return 1;
+
+  const int closed = fclose(writer->f) == 0;
+  int success =
+      check(writer->next_row == writer->height, "Image incomplete") &&
+      check(closed, "Writing pixels failed");
+
+  free(writer);
+  *writerp = NULL;
+  return success;
+}
+
+/// Blur an image being streamed, as ImageBlur does.
+/// Reads all rows from reader and writes the blurred rows to writer.
+/// Only the (2dy+1) rows of the filter window are kept in memory.
+/// Requires: the writer dimensions must be the same as the reader's, and
+/// no rows may have been read or written yet.
+/// On success, returns nonzero.
+/// On failure, returns 0 and errno/errCause are set accordingly.
+int ImageStreamBlur(ImageReader reader, ImageWriter writer, int dx,
+                    int dy) { ///
+  assert(reader != NULL);
+  assert(writer != NULL);
+  assert(dx >= 0 && dy >= 0);
+  assert(writer->width == reader->width && writer->height == reader->height);
+  assert(reader->next_row == 0 && writer->next_row == 0);
+
+  const int width = reader->width;
+  const int height = reader->height;
+  if (height == 0)
+    return 1;
+
+  // The same algorithm as in ImageBlur is used, but instead of the whole
+  // image only a ring with the rows in the filter window is kept in memory,
+  // row r is stored in the slot r % (2dy+1).
+  //
+  // When a line is processed, the row that leaves the window (y-dy-1) and the
+  // row that enters it (y+dy) share the same slot, so the leaving row is
+  // subtracted from the sum vector before the entering row is read over it.
+  const int win_height = 2 * dy + 1;
+  const int ring_size = win_height < height ? win_height : height;
+  uint8 *ring = (uint8 *)malloc((size_t)ring_size * width * sizeof(uint8));
+  uint8 *line = (uint8 *)malloc(width * sizeof(uint8));
+  int *line_sum = (int *)malloc(width * sizeof(int));
+
+  int success = check(ring != NULL && line != NULL && line_sum != NULL,
+                      "Failed to allocate memory");
 
-    // For all remaining pixels in the line update the sum by removing the first
-    // pixel in the previous filter window and adding the new pixel and. Then
-    // the blurred pixel value is calculated and updated as done previously.
-    for (int x = 1; x < img->width; x++) {
-      const int prev_x = clamp(x - dx - 1, 0, last_x);
-      const int next_x = clamp(x + dx, 0, last_x);
+  const int last_y = height - 1;
+  const int radius_y = height > dy ? dy : last_y;
+  const int spill_y = dy >= height ? dy - radius_y + 1 : 1;
+  struct blurDivisor div;
+  blurDivisorInit(&div, (2 * dx + 1) * win_height);
 
-      sum += line_sum[next_x] - line_sum[prev_x];
-      PIXMEM++; // count one pixel access (write)
-      blurred_pixels[G(img, x, y)] = round_div(sum, win_area);
+  // Read all the rows needed for the first line, and do the initialization
+  // phase (see ImageBlur) with them.
+  success = success && readRows(reader, ring, radius_y + 1) == radius_y + 1;
+  if (success) {
+    const uint8 *last = ring + radius_y * width;
+    for (int x = 0; x < width; x++) {
+      line_sum[x] = (dy + 1) * ring[x];
+      for (int half_win_y = 1; half_win_y < radius_y; half_win_y++) {
+        line_sum[x] += ring[half_win_y * width + x];
+      }
+      line_sum[x] += spill_y * last[x];
     }
   }
 
-  // At this point blurred_pixels contains the new values and the old pixels
-  // memory is no longer useful so the pointers are swapped and the old pointer
-  // is deallocated.
-  uint8 *temp = img->pixel;
-  img->pixel = blurred_pixels;
-  free(temp);
+  for (int y = 0; success && y < height; y++) {
+    if (y != 0) {
+      // Update phase (see ImageBlur)
+      const int prev_y = clamp(y - dy - 1, 0, last_y);
+      const int next_y = clamp(y + dy, 0, last_y);
+      const uint8 *prev = ring + (prev_y % win_height) * width;
+      uint8 *next = ring + (next_y % win_height) * width;
+
+      for (int x = 0; x < width; x++) {
+        line_sum[x] -= prev[x];
+      }
+      // The entering row is read only once, when it isn't clamped
+      if (next_y == y + dy && readRows(reader, next, 1) != 1) {
+        success = 0;
+        break;
+      }
+      for (int x = 0; x < width; x++) {
+        line_sum[x] += next[x];
+      }
+    }
+
+    // Blur phase
+    blurRow(line, line_sum, 0, 0, width, width, dx, &div);
+    COUNT(PIXMEM, width); // count one pixel access (write) each
+    COUNT(DIVISIONS, width);
+    success = writeRows(writer, line, 1);
+  }
+
+  // Cleanup
+  errsave = errno;
+  free(ring);
+  free(line);
+  free(line_sum);
+  errno = errsave;
+  return success;
 }
@@ -23,6 +23,15 @@ extern const uint8 PixMax;
 // Type Image is a pointer to image objects
 typedef struct image *Image;
 
+// Types ImageReader and ImageWriter are pointers to objects that read and
+// write PGM files a strip of rows at a time
+typedef struct imageReader *ImageReader;
+typedef struct imageWriter *ImageWriter;
+
+// Type ImageIntegral is a pointer to integral image (summed-area table)
+// objects
+typedef struct imageIntegral *ImageIntegral;
+
 /// Error handling functions
 
 /// Error cause.
@@ -36,9 +45,14 @@ typedef struct image *Image;
 char* ImageErrMsg() ;
 
 /// Init Image library.  (Call once!)
-/// Currently, simply calibrate instrumentation and set names of counters.
+/// Currently, simply set names of counters.
+/// (Instrumentation is calibrated only when needed, see InstrGetCTU.)
 void ImageInit(void) ;
 
+/// Set the number of threads used by the operations that run in parallel.
+/// 0 (the default) uses one thread per online processor.
+void ImageSetThreads(int threads) ;
+
 /// Image management functions
 
 /// Create a new black image.
@@ -67,6 +81,17 @@ void ImageDestroy(Image* imgp) ;
 /// On failure, returns NULL and errno/errCause are set accordingly.
 Image ImageLoad(const char* filename) ;
 
+/// Load a raw PGM file by mapping it into memory.
+/// Only 8 bit PGM files are accepted.
+/// The file is mapped copy-on-write and the image pixels point into the
+/// mapping, so only the pages actually accessed are read from the file.
+/// Operations that modify the image never change the file.
+/// Otherwise, behaves exactly like ImageLoad.
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+Image ImageLoadMapped(const char* filename) ;
+
 /// Save image to PGM file.
 /// On success, returns nonzero.
 /// On failure, returns 0, errno/errCause are set appropriately, and
@@ -135,6 +160,35 @@ void ImageThreshold(Image img, uint8 thr) ;
 /// darken the image if factor<1.0.
 void ImageBrighten(Image img, double factor) ;
 
+/// Lookup tables
+
+/// Each pixel transformation maps every level to a new level, regardless of
+/// the pixel position, so it can be described by a 256-entry lookup table
+/// (LUT), where lut[level] is the new level.
+/// A chain of pixel transformations can then be applied in a single pass
+/// over the image, by composing their tables and applying the result:
+///   uint8 lut[256];
+///   ImageIdentityLUT(lut);
+///   ImageNegativeLUT(img, lut);
+///   ImageThresholdLUT(img, lut, 100);
+///   ImageApplyLUT(img, lut);  // same as ImageNegative + ImageThreshold
+
+/// Set lut to the identity table (lut[level] == level).
+void ImageIdentityLUT(uint8 lut[256]) ;
+
+/// Compose ImageNegative (for img) after the transformation in lut.
+void ImageNegativeLUT(Image img, uint8 lut[256]) ;
+
+/// Compose ImageThreshold (for img) after the transformation in lut.
+void ImageThresholdLUT(Image img, uint8 lut[256], uint8 thr) ;
+
+/// Compose ImageBrighten (for img) after the transformation in lut.
+void ImageBrightenLUT(Image img, uint8 lut[256], double factor) ;
+
+/// Apply a lookup table to image.
+/// Transform each pixel level into lut[level].
+void ImageApplyLUT(Image img, const uint8 lut[256]) ;
+
 /// Geometric transformations
 
 /// These functions apply geometric transformations to an image,
@@ -155,6 +209,30 @@ void ImageBrighten(Image img, double factor) ;
 /// On failure, returns NULL and errno/errCause are set accordingly.
 Image ImageRotate(Image img) ;
 
+/// Rotate an image by 180 degrees.
+/// Returns a rotated version of the image.
+/// Ensures: The original img is not modified.
+///
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+Image ImageRotate180(Image img) ;
+
+/// Rotate an image by 270 degrees anti-clockwise (90 degrees clockwise).
+/// Returns a rotated version of the image.
+/// Ensures: The original img is not modified.
+///
+/// On success, a new image is returned.
+/// (The caller is responsible for destroying the returned image!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+Image ImageRotate270(Image img) ;
+
+/// Rotate a square image in place.
+/// The rotation is 90 degrees anti-clockwise, as in ImageRotate, but img is
+/// modified instead of allocating a new image.
+/// Requires: img must be square (width == height).
+void ImageRotateInPlace(Image img) ;
+
 /// Mirror an image = flip left-right.
 /// Returns a mirrored version of the image.
 /// Ensures: The original img is not modified.
@@ -205,12 +283,265 @@ int ImageMatchSubImage(Image img1, int x, int y, Image img2) ;
 /// If no match is found, returns 0 and (*px, *py) are left untouched.
 int ImageLocateSubImage(Image img1, int* px, int* py, Image img2) ;
 
+/// Integral images
+
+/// Create the integral image (summed-area table) of img, from which the sum
+/// of the levels in any rectangle is computed in constant time, and also the
+/// sum of their squares, if squares is nonzero.
+/// The sums are 64-bit, and large images are summed by as many threads as
+/// set by ImageSetThreads.
+/// Ensures: img is not modified (and may be destroyed afterwards).
+///
+/// On success, a new integral image is returned.
+/// (The caller is responsible for destroying the returned integral image!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+ImageIntegral ImageIntegralCreate(Image img, int squares) ;
+
+/// Destroy the integral image pointed to by (*iip).
+/// If (*iip)==NULL, no operation is performed.
+/// Ensures: (*iip)==NULL.
+void ImageIntegralDestroy(ImageIntegral* iip) ;
+
+/// Sum of the levels in rectangle (x, y, w, h) of the image of ii.
+/// The rectangle may extend beyond the image, whose pixels outside are those
+/// of the nearest border pixel (as in ImageBlur).
+/// Requires: w, h >= 0, and the image must not be empty, if w*h > 0.
+uint64_t ImageRectSum(ImageIntegral ii, int x, int y, int w, int h) ;
+
+/// Sum of the squares of the levels in rectangle (x, y, w, h) of the image of
+/// ii, as ImageRectSum.
+/// Requires: ii must have been created with the squares.
+uint64_t ImageRectSumSq(ImageIntegral ii, int x, int y, int w, int h) ;
+
+/// Mean of the levels in rectangle (x, y, w, h) of the image of ii, as
+/// ImageRectSum.
+/// Requires: w, h > 0.
+double ImageRectMean(ImageIntegral ii, int x, int y, int w, int h) ;
+
+/// Approximate matching
+
+/// Scores of how well a subimage matches a window of an image:
+///   IMAGE_SAD: sum of absolute differences (lower is better, 0 is exact);
+///   IMAGE_SSD: sum of squared differences (lower is better, 0 is exact);
+///   IMAGE_NCC: normalized cross-correlation (higher is better, in [-1, 1],
+///     1 is exact up to brightness and contrast, 0 if either is flat).
+typedef enum { IMAGE_SAD, IMAGE_SSD, IMAGE_NCC } ImageScore;
+
+/// Position (x, y) of a subimage in an image, its score there, and which
+/// subimage it is (for searches of multiple subimages).
+typedef struct {
+  int x;
+  int y;
+  double score;
+  int index;
+} ImageMatch;
+
+/// Locate all approximate matches of a subimage.
+/// Searches for img2 inside img1, and finds the positions where its score is
+/// at least as good as threshold (<= for SAD and SSD, >= for NCC).
+/// The best max of them are stored in matches[0..max-1], best first (and in
+/// raster order, for equal scores).
+/// On success, returns the number of matches found (which may be more than
+/// max, then only the best max are stored, so a caller may search again with
+/// room for all of them).
+/// On failure, returns -1 and errno/errCause are set accordingly.
+int ImageLocateAll(Image img1, Image img2, ImageScore score, double threshold,
+                   ImageMatch* matches, int max) ;
+
+/// Set when ImageLocateAll uses the FFT correlation.
+/// For SSD and NCC scores, the products of img2 with all the windows of img1
+/// are computed by FFT when the number of pixels compared otherwise (number
+/// of positions times area of img2) is more than crossover * P*Q*log2(P*Q),
+/// where P by Q is the size of img1 rounded up to powers of 2.
+/// So 0 always uses the FFT, and INFINITY never does.
+void ImageSetFFTCrossover(double crossover) ;
+
+/// Locate several subimages at once.
+/// Searches for all subimages sub[0..count-1] inside img, in a single pass
+/// over img for each distinct subimage width.
+/// Requires: the subimages must not be empty.
+/// The matches are stored in matches[0..max-1], in raster order (and by
+/// subimage, for the same position), each with the index of its subimage in
+/// sub (and score 0).
+/// On success, returns the number of matches found (which may be more than
+/// max, then only the first max are stored).
+/// On failure, returns -1 and errno/errCause are set accordingly.
+int ImageLocateMany(Image img, Image* sub, int count, ImageMatch* matches,
+                    int max) ;
+
+/// Locate a subimage in any of its 8 orientations.
+/// Searches for img2 inside img1, rotated 90º counter-clockwise r times
+/// (0 to 3) after being mirrored (m = 1) or not (m = 0), which is orientation
+/// 4 * m + r.
+/// If a match is found, returns 1 and the first matching position (in raster
+/// order) and its lowest orientation are set in vars (*px, *py, *porient).
+/// If no match is found, returns 0 and (*px, *py, *porient) are left
+/// untouched.
+/// On failure, returns -1 and errno/errCause are set accordingly.
+int ImageLocateOriented(Image img1, int* px, int* py, int* porient,
+                        Image img2) ;
+
 /// Filtering
 
 /// Blur an image by a applying a (2dx+1)x(2dy+1) mean filter.
 /// Each pixel is substituted by the mean of the pixels in the rectangle
 /// [x-dx, x+dx]x[y-dy, y+dy].
 /// The image is changed in-place.
+/// Only the square 3x3, 5x5 and 7x7 windows (dx == dy, from 1 to 3) are
+/// blurred by specialized kernels, which give the same result and counts;
+/// any other window, such as 3x5, is blurred with running sums.
 void ImageBlur(Image img, int dx, int dy) ;
 
+/// Blur an image in place, as ImageBlur does, without a second raster.
+/// Only a ring with the last (dy+1) original rows still needed is kept, so
+/// the extra memory is O(width*dy) instead of O(width*height).
+/// On success, returns nonzero.
+/// On failure, returns 0, the image is unchanged and errno/errCause are set
+/// accordingly.
+int ImageBlurInPlace(Image img, int dx, int dy) ;
+
+/// Blur an image with a different mean filter for each pixel.
+/// Each pixel (x, y) is substituted by the mean of the pixels in the square
+/// [x-r, x+r]x[y-r, y+r], where r is the level of pixel (x, y) of radius,
+/// with the pixels outside the image clamped to its border, as in ImageBlur
+/// (so, for a radius image with a single level r >= 1, the result is the
+/// same as ImageBlur(img, r, r), for images with at least 2 rows and
+/// columns).
+/// Requires: radius must have the same size as img.
+/// On success, returns nonzero.
+/// On failure, returns 0, the image is unchanged and errno/errCause are set
+/// accordingly.
+int ImageBlurRadiusMap(Image img, Image radius) ;
+
+/// Blur an image with an approximation of a Gaussian filter with standard
+/// deviation sigma (in pixels), with the pixels outside the image clamped to
+/// its border, as in ImageBlur.
+/// The filter is 3 box filters in a row, along the rows and along the
+/// columns, so the cost does not depend on sigma. The intermediate levels are
+/// kept in 16 bits, and only the final result is rounded to 8 bits.
+/// Requires: 0 <= sigma <= 10000.
+/// On success, returns nonzero.
+/// On failure, returns 0, the image is unchanged and errno/errCause are set
+/// accordingly.
+int ImageGaussianBlur(Image img, double sigma) ;
+
+/// Convolve an image with a separable integer kernel: the product of kernel
+/// kx (of nx taps) along the rows and kernel ky (of ny taps) along the
+/// columns, both centered on the pixel, with the pixels outside the image
+/// clamped to its border, as in ImageBlur.
+/// Each pixel is substituted by its convolution sum divided by divisor,
+/// rounded to the nearest integer, plus offset, saturated to [0, maxval].
+/// (For example, kx = {-1, 0, 1}, ky = {1, 2, 1}, divisor 8 and offset 128
+/// give the horizontal Sobel derivative, and kx = ky = {1, 1, 1} with divisor
+/// 9 gives ImageBlur(img, 1, 1).)
+/// Requires: nx and ny must be odd and positive, divisor > 0, and
+/// PixMax * (sum of |kx|) * (sum of |ky|) must fit in an int.
+/// On success, returns nonzero.
+/// On failure, returns 0, the image is unchanged and errno/errCause are set
+/// accordingly.
+int ImageConvolve(Image img, const int *kx, int nx, const int *ky, int ny,
+                  int divisor, int offset) ;
+
+/// Apply a (2dx+1)x(2dy+1) median filter to an image.
+/// Each pixel is substituted by the median of the pixels in the rectangle
+/// [x-dx, x+dx]x[y-dy, y+dy], with the pixels outside the image clamped to
+/// its border, as in ImageBlur.
+/// The cost per pixel does not depend on the radii (it uses histograms of
+/// the columns of the window, updated incrementally).
+/// Large images are filtered by as many threads as set by ImageSetThreads,
+/// each doing strips of columns, with the same result.
+/// Requires: 0 <= dx, dy <= 32767.
+/// On success, returns nonzero.
+/// On failure, returns 0, the image is unchanged and errno/errCause are set
+/// accordingly.
+int ImageMedian(Image img, int dx, int dy) ;
+
+/// Streaming
+
+/// These functions process PGM files a strip of rows at a time, so that
+/// images larger than the available memory can be processed.
+///
+/// A strip is an Image with the width of the file and as many rows as are to
+/// be processed at once, so all pixel transformations (ImageNegative,
+/// ImageThreshold, ImageBrighten) can be applied to it directly:
+///   ImageReader in = ImageReaderOpen("in.pgm");
+///   ImageWriter out = ImageWriterOpen("out.pgm", ImageReaderWidth(in),
+///                                     ImageReaderHeight(in),
+///                                     ImageReaderMaxval(in));
+///   Image strip = ImageCreate(ImageReaderWidth(in), 64, ImageReaderMaxval(in));
+///   while (ImageReaderRead(in, strip) > 0) {
+///     ImageNegative(strip);
+///     ImageWriterWrite(out, strip);
+///   }
+///   ImageWriterClose(&out);
+///   ImageReaderClose(&in);
+///   ImageDestroy(&strip);
+/// (Error checking omitted for brevity.)
+
+/// Open a raw PGM file for reading it a strip of rows at a time.
+/// Only 8 bit PGM files are accepted.
+/// On success, a new reader is returned.
+/// (The caller is responsible for closing the returned reader!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+ImageReader ImageReaderOpen(const char* filename) ;
+
+/// Close the reader pointed to by (*readerp).
+/// If (*readerp)==NULL, no operation is performed.
+/// Ensures: (*readerp)==NULL.
+void ImageReaderClose(ImageReader* readerp) ;
+
+/// Get the width of the image being read
+int ImageReaderWidth(ImageReader reader) ;
+
+/// Get the height of the image being read
+int ImageReaderHeight(ImageReader reader) ;
+
+/// Get the maximum gray level of the image being read
+int ImageReaderMaxval(ImageReader reader) ;
+
+/// Read the next strip of rows.
+/// Reads the next ImageHeight(strip) rows (or less, if the end of the image
+/// is reached) into strip, and sets the strip height to the number of rows
+/// read.
+/// Requires: the strip width must be the same as the reader's.
+/// On success, returns the number of rows read (0 at the end of the image).
+/// On failure, returns -1 and errno/errCause are set accordingly.
+int ImageReaderRead(ImageReader reader, Image strip) ;
+
+/// Create a raw PGM file for writing it a strip of rows at a time.
+///   width, height : the dimensions of the image.
+///   maxval: the maximum gray level (corresponding to white).
+/// Requires: width and height must be non-negative, maxval > 0.
+/// On success, a new writer is returned.
+/// (The caller is responsible for closing the returned writer!)
+/// On failure, returns NULL and errno/errCause are set accordingly.
+ImageWriter ImageWriterOpen(const char* filename, int width, int height,
+                            uint8 maxval) ;
+
+/// Write a strip of rows.
+/// Appends all rows of strip to the image being written.
+/// Requires: the strip width must be the same as the writer's, and the strip
+/// must not exceed the remaining rows.
+/// On success, returns nonzero.
+/// On failure, returns 0 and errno/errCause are set accordingly.
+int ImageWriterWrite(ImageWriter writer, Image strip) ;
+
+/// Close the writer pointed to by (*writerp).
+/// If (*writerp)==NULL, no operation is performed.
+/// Ensures: (*writerp)==NULL.
+/// On success, returns nonzero.
+/// On failure (including not all rows being written), returns 0,
+/// errno/errCause are set appropriately, and a partial and invalid file may
+/// be left in the system.
+int ImageWriterClose(ImageWriter* writerp) ;
+
+/// Blur an image being streamed, as ImageBlur does.
+/// Reads all rows from reader and writes the blurred rows to writer.
+/// Only the (2dy+1) rows of the filter window are kept in memory.
+/// Requires: the writer dimensions must be the same as the reader's, and
+/// no rows may have been read or written yet.
+/// On success, returns nonzero.
+/// On failure, returns 0 and errno/errCause are set accordingly.
+int ImageStreamBlur(ImageReader reader, ImageWriter writer, int dx, int dy) ;
+
 #endif
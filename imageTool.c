@@ -15,6 +15,10 @@
 #include <errno.h>
 #include "error.h"
 #include <assert.h>
+#include <glob.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
 
 #include "image8bit.h"
 #include "instrumentation.h"
@@ -34,19 +38,33 @@ static const char* USAGE =
     "  Currently, only image files in 8-bit raw PGM format are accepted.\n"
     "  Input file names must be distinct from operation names.\n"
     "\n"
+    "BATCH MODE:\n"
+    "  imageTool batch [-jTHREADS] INPUT [OPERATION [OPERAND...]]\n"
+    "  Apply the pipeline to each file matched by INPUT, a glob pattern, or\n"
+    "  listed in file LIST if INPUT is @LIST (one file name per line).\n"
+    "  Files are processed in parallel by THREADS threads (default: one per\n"
+    "  core), each is loaded as I0 and in save operands %s is replaced by its\n"
+    "  name without directory.  The total throughput is printed at the end.\n"
+    "\n"
     "OPERATIONS:\n"
     "  FILE            Load PGM image file, creating new image\n"
+    "  map FILE        Load PGM image file by mapping it in memory\n"
     "  save FILE       Save CURR to PGM file\n"
     "  info            Show information on CURR (size and range)\n"
     "  tic             Reset instrumentation counters and times.\n"
     "  toc             Print instrumentation counters and times.\n"
+    "  threads T       Use T threads in parallel operations (0: one per CPU)\n"
     "\n"              
     "  neg             Apply photo-negative effect to CURR\n"
     "  thr LEVEL       Apply thresholding to CURR\n"
     "  bri FACTOR      Scale brightness in CURR by FACTOR\n"
+    "                  (Consecutive neg, thr and bri are applied in one pass.)\n"
     "\n"              
     "  create W,H      Create new black image with WxH pixels\n"
     "  rotate          Rotate CURR 90º counter-clockwise, creating new image\n"
+    "  rotate180       Rotate CURR 180º, creating new image\n"
+    "  rotate270       Rotate CURR 270º counter-clockwise, creating new image\n"
+    "  irotate         Rotate square CURR 90º counter-clockwise, in place\n"
     "  mirror          Mirror CURR left-to-right, creating new image\n"
     "  crop X,Y,W,H    Crop a rectangle from CURR, creating new image\n"
     "\n"              
@@ -54,8 +72,31 @@ static const char* USAGE =
     "  blend X,Y,alpha Blend PRED into CURR at position (X,Y) with given alpha\n"
     "\n"              
     "  locate          Search PRED in CURR, print matching position, or NOTFOUND\n"
+    "  locateany       Search PRED in CURR in any orientation, print matching\n"
+    "                  position and orientation (R rotations, M if mirrored\n"
+    "                  first), or NOTFOUND\n"
+    "  locateall S,T[,K]\n"
+    "                  Search PRED in CURR approximately, print the (best K)\n"
+    "                  positions where score S (sad, ssd or ncc) beats T\n"
+    "  locatemany K    Search the K images before CURR in CURR, print all\n"
+    "                  matching positions, or NOTFOUND\n"
     "\n"              
     "  blur DX,DY      blur CURR using (2DX+1)x(2Dy+1) mean filter\n"
+    "  iblur DX,DY     blur CURR in place, keeping only DY+1 rows aside\n"
+    "  gauss SIGMA     blur CURR with an approximate Gaussian filter\n"
+    "  mapblur         blur CURR with the radius at each pixel given by the\n"
+    "                  level of PRED (of the same size)\n"
+    "  conv KX/KY/D[,O]\n"
+    "                  convolve CURR with separable kernel KX along rows and\n"
+    "                  KY along columns (comma-separated integers, odd count),\n"
+    "                  divide by D and add O (0 by default)\n"
+    "  median DX,DY    filter CURR using (2DX+1)x(2DY+1) median filter\n"
+    "  rect X,Y,W,H    print the sum and mean of the levels in a rectangle of\n"
+    "                  CURR (clamped to its border)\n"
+    "\n"
+    "  stream IN OUT OP [OPERAND]\n"
+    "                  Apply OP (neg, thr, bri or blur) to file IN, saving the\n"
+    "                  result to file OUT, without loading the whole image\n"
     "\n"              
     "OPERANDS:\n"     
     "  X,Y             Pixel coordinates: 0,0 is top left corner\n"
@@ -74,9 +115,66 @@ static char* errors[] = {
   "Invalid operand",
   "Invalid rect (overflow)",
   "Invalid alpha",
+  "Some files failed",
 };
 
 
+// Number of rows processed at once by the stream operation
+#define STREAM_ROWS 64
+
+// Apply operation op, with the given operand (NULL for neg), to the PGM file
+// named in, writing the result to the PGM file named out, a strip at a time.
+// Returns 0 on success, or the index of the error message on failure.
+static int streamOperation(const char* in, const char* out, const char* op,
+                           const char* operand) {
+  uint8 thr;
+  double factor;
+  int dx, dy;
+
+  // Validate the operation and operand before touching any file
+  if (strcmp(op, "neg") == 0) {
+  } else if (strcmp(op, "thr") == 0) {
+    if (sscanf(operand, "%hhu", &thr) != 1) return 5;
+  } else if (strcmp(op, "bri") == 0) {
+    if (sscanf(operand, "%lf", &factor) != 1) return 5;
+  } else if (strcmp(op, "blur") == 0) {
+    if (sscanf(operand, "%d,%d", &dx, &dy) != 2) return 5;
+  } else {
+    return 5;
+  }
+
+  ImageReader reader = ImageReaderOpen(in);
+  if (reader == NULL) return 4;
+  int w = ImageReaderWidth(reader);
+  int h = ImageReaderHeight(reader);
+  uint8 maxval = ImageReaderMaxval(reader);
+  ImageWriter writer = ImageWriterOpen(out, w, h, maxval);
+  Image strip = ImageCreate(w, STREAM_ROWS, maxval);
+
+  int success = writer != NULL && strip != NULL;
+  if (success && strcmp(op, "blur") == 0) {
+    success = ImageStreamBlur(reader, writer, dx, dy);
+  } else if (success) {
+    int rows;
+    while ((rows = ImageReaderRead(reader, strip)) > 0) {
+      if (strcmp(op, "neg") == 0) {
+        ImageNegative(strip);
+      } else if (strcmp(op, "thr") == 0) {
+        ImageThreshold(strip, thr);
+      } else {
+        ImageBrighten(strip, factor);
+      }
+      if (!ImageWriterWrite(writer, strip)) break;
+    }
+    success = rows == 0;
+  }
+  success = ImageWriterClose(&writer) && success;
+
+  ImageDestroy(&strip);
+  ImageReaderClose(&reader);
+  return success ? 0 : 4;
+}
+
 // This program strives for correctness and robustness.
 // You may want to temporarily comment out operand validation, namely
 // precondition checks, so that you can force precondition violations, and
@@ -85,27 +183,127 @@ static char* errors[] = {
 // Also, the program does not test every module function, but you may easily
 // add new operations for that purpose.
 
-int main(int ac, char* av[]) {
-  program_name = av[0];
-  if (ac <= 1) {
-    error(5, 0, "\n%s", USAGE);
+// The image buffer capacity
+enum { N = 10 };
+
+// Whether to log each operation to stderr (disabled in batch mode)
+static int verbose = 1;
+
+#define LOG(...)                                                               \
+  do {                                                                         \
+    if (verbose)                                                               \
+      fprintf(stderr, __VA_ARGS__);                                            \
+  } while (0)
+
+// Initial number of matches held by the locateall and locatemany operations
+#define LOCATE_MATCHES 1024
+
+// Maximum number of taps of each kernel of the conv operation
+#define CONV_TAPS 63
+
+// Parse a kernel of comma-separated integers from str into k (with up to max
+// taps), ending at '/' or the end of str.
+// Returns the number of taps, or 0 if str is not a valid kernel, and stores
+// the position after the kernel in (*end).
+static int parseKernel(const char* str, int k[], int max, const char** end) {
+  int n = 0;
+  for (;;) {
+    char* next;
+    errno = 0;
+    const long tap = strtol(str, &next, 10);
+    if (next == str || errno != 0 || tap < -65536 || tap > 65536 || n >= max)
+      return 0;
+    k[n++] = (int)tap;
+    str = next;
+    if (*str != ',') break;
+    str++;
   }
+  *end = str;
+  return n;
+}
 
-  ImageInit();
+// Build the name of an output file into buf (with the given size).
+// In batch mode (input != NULL), the first %s in name is replaced by the
+// input file name without its directory, otherwise name is used as is.
+static const char* outputName(char* buf, size_t size, const char* name,
+                              const char* input) {
+  const char* subst = input != NULL ? strstr(name, "%s") : NULL;
+  if (subst == NULL) return name;
+
+  const char* base = strrchr(input, '/');
+  base = base != NULL ? base + 1 : input;
+  snprintf(buf, size, "%.*s%s%s", (int)(subst - name), name, base, subst + 2);
+  return buf;
+}
+
+// Pixel transformations (neg, thr and bri) pending on CURR.
+struct pointOps {
+  int count;        // number of pending operations
+  int first;        // index in av of the first pending operation
+  uint8 lut[256];   // composition of the pending operations
+};
+
+// Is op a pixel transformation?
+static int isPointOp(const char* op) {
+  return strcmp(op, "neg") == 0 || strcmp(op, "thr") == 0 ||
+         strcmp(op, "bri") == 0;
+}
+
+// Add the operation av[k] to the pending operations.
+// The caller must then compose it into ops->lut.
+static void addPointOp(struct pointOps* ops, int k) {
+  if (ops->count == 0) {
+    ops->first = k;
+    ImageIdentityLUT(ops->lut);
+  }
+  ops->count++;
+}
 
+// Apply the pending operations to image img.
+// A single operation is applied directly, since the dedicated functions are
+// faster than a generic lookup table; its operand was validated when it was
+// added.
+static void flushPointOps(struct pointOps* ops, char* av[], Image img) {
+  if (ops->count == 1) {
+    const char* op = av[ops->first];
+    if (strcmp(op, "neg") == 0) {
+      ImageNegative(img);
+    } else if (strcmp(op, "thr") == 0) {
+      uint8 thr;
+      sscanf(av[ops->first + 1], "%hhu", &thr);
+      ImageThreshold(img, thr);
+    } else {
+      double factor;
+      sscanf(av[ops->first + 1], "%lf", &factor);
+      ImageBrighten(img, factor);
+    }
+  } else {
+    ImageApplyLUT(img, ops->lut);
+  }
+  ops->count = 0;
+}
+
+// Run the pipeline of operations in av[k..ac-1] over the image buffer img,
+// which holds (*np) images. input is the name of the file being processed
+// in batch mode (NULL otherwise).
+// On return, (*np) is the number of images in the buffer.
+// Returns 0 on success, or the index of the error message on failure.
+static int runPipeline(int ac, char* av[], int k, Image img[], int* np,
+                       const char* input) {
   int err = 0;
   int x, y, w, h;
+  int n = *np;        // number of images created
+  char name[4096];    // output file name
+  struct pointOps ops = { 0 };  // pending pixel transformations
 
-  // The image buffer
-  const int N = 10;   // buffer capacity
-  Image img[N];     // the images
-  int n = 0;          // number of images created
-
-  int k = 1;
   while (k < ac) {
+    // Consecutive neg, thr and bri operations are composed and only applied,
+    // in a single pass over CURR, before the next operation of another kind.
+    if (ops.count > 0 && !isPointOp(av[k])) flushPointOps(&ops, av, img[n-1]);
+
     if (strcmp(av[k], "info") == 0) {
       if (n < 1) { err = 2; break; }
-      fprintf(stderr, "Info on I%d\n", n-1);
+      LOG("Info on I%d\n", n-1);
       uint8 min, max;
       w = ImageWidth(img[n-1]);
       h = ImageHeight(img[n-1]);
@@ -113,48 +311,76 @@ int main(int ac, char* av[]) {
       ImageStats(img[n-1], &min, &max);
       printf("# Size: %dx%d\n# Maxval: %hhu\n", w, h, maxval);
       printf("# Gray level range: [%hhu, %hhu]\n", min, max);
+    } else if (strcmp(av[k], "threads") == 0) {
+      if (++k >= ac) { err = 1; break; }
+      int threads;
+      if (sscanf(av[k], "%d", &threads) != 1 || threads < 0) { err = 5; break; }
+      LOG("Using %d threads\n", threads);
+      ImageSetThreads(threads);
     } else if (strcmp(av[k], "tic") == 0) {
       InstrReset();
     } else if (strcmp(av[k], "toc") == 0) {
       InstrPrint();
     } else if (strcmp(av[k], "neg") == 0) {
       if (n < 1) { err = 2; break; }
-      fprintf(stderr, "Negating I%d\n", n-1);
-      ImageNegative(img[n-1]);
+      LOG("Negating I%d\n", n-1);
+      addPointOp(&ops, k);
+      ImageNegativeLUT(img[n-1], ops.lut);
     } else if (strcmp(av[k], "thr") == 0) {
       if (++k >= ac) { err = 1; break; }
       if (n < 1) { err = 2; break; }
       uint8 thr;
       if (sscanf(av[k], "%hhu", &thr) != 1) { err = 5; break; }
-      fprintf(stderr, "Thresholding I%d at %d\n", n-1, thr);
-      ImageThreshold(img[n-1], (uint8)thr);
+      LOG("Thresholding I%d at %d\n", n-1, thr);
+      addPointOp(&ops, k-1);
+      ImageThresholdLUT(img[n-1], ops.lut, thr);
     } else if (strcmp(av[k], "bri") == 0) {
       if (++k >= ac) { err = 1; break; }
       if (n < 1) { err = 2; break; }
       double factor;
       if (sscanf(av[k], "%lf", &factor) != 1) { err = 5; break; }
-      fprintf(stderr, "Brightening I%d by %lf\n", n-1, factor);
-      ImageBrighten(img[n-1], factor);
+      LOG("Brightening I%d by %lf\n", n-1, factor);
+      addPointOp(&ops, k-1);
+      ImageBrightenLUT(img[n-1], ops.lut, factor);
     } else if (strcmp(av[k], "create") == 0) {
       if (++k >= ac) { err = 1; break; }
       if (n >= N) { err = 3; break; }
       if (sscanf(av[k], "%d,%d", &w, &h) != 2) { err = 5; break; }
       if (w < 0 || h < 0) { err = 5; break; }   // precondition check!
-      fprintf(stderr, "Creating black image (%d,%d) -> I%d\n", w, h, n);
+      LOG("Creating black image (%d,%d) -> I%d\n", w, h, n);
       img[n] = ImageCreate(w, h, PixMax);
       if (img[n] == NULL) { err = 4; break; }
       n++;
     } else if (strcmp(av[k], "rotate") == 0) {
       if (n < 1) { err = 2; break; }
       if (n >= N) { err = 3; break; }
-      fprintf(stderr, "Rotating I%d -> I%d\n", n-1, n);
+      LOG("Rotating I%d -> I%d\n", n-1, n);
       img[n] = ImageRotate(img[n-1]);
       if (img[n] == NULL) { err = 4; break; }
       n++;
+    } else if (strcmp(av[k], "rotate180") == 0) {
+      if (n < 1) { err = 2; break; }
+      if (n >= N) { err = 3; break; }
+      LOG("Rotating I%d by 180º -> I%d\n", n-1, n);
+      img[n] = ImageRotate180(img[n-1]);
+      if (img[n] == NULL) { err = 4; break; }
+      n++;
+    } else if (strcmp(av[k], "rotate270") == 0) {
+      if (n < 1) { err = 2; break; }
+      if (n >= N) { err = 3; break; }
+      LOG("Rotating I%d by 270º -> I%d\n", n-1, n);
+      img[n] = ImageRotate270(img[n-1]);
+      if (img[n] == NULL) { err = 4; break; }
+      n++;
+    } else if (strcmp(av[k], "irotate") == 0) {
+      if (n < 1) { err = 2; break; }
+      if (ImageWidth(img[n-1]) != ImageHeight(img[n-1])) { err = 5; break; }   // precondition check!
+      LOG("Rotating I%d in place\n", n-1);
+      ImageRotateInPlace(img[n-1]);
     } else if (strcmp(av[k], "mirror") == 0) {
       if (n < 1) { err = 2; break; }
       if (n >= N) { err = 3; break; }
-      fprintf(stderr, "Mirroring I%d -> I%d\n", n-1, n);
+      LOG("Mirroring I%d -> I%d\n", n-1, n);
       img[n] = ImageMirror(img[n-1]);
       if (img[n] == NULL) { err = 4; break; }
       n++;
@@ -164,7 +390,7 @@ int main(int ac, char* av[]) {
       if (n >= N) { err = 3; break; }
       if (sscanf(av[k], "%d,%d,%d,%d", &x, &y, &w, &h) != 4) { err = 5; break; }
       if (!ImageValidRect(img[n-1], x, y, w, h)) { err = 5; break; }   // precondition check!
-      fprintf(stderr, "Cropping I%d (%d,%d,%d,%d) -> I%d\n", n-1, x, y, w, h, n);
+      LOG("Cropping I%d (%d,%d,%d,%d) -> I%d\n", n-1, x, y, w, h, n);
       img[n] = ImageCrop(img[n-1], x, y, w, h);
       if (img[n] == NULL) { err = 4; break; }
       n++;
@@ -175,7 +401,7 @@ int main(int ac, char* av[]) {
       w = ImageWidth(img[n-2]);
       h = ImageHeight(img[n-2]);
       if (!ImageValidRect(img[n-1], x, y, w, h)) { err = 6; break; }
-      fprintf(stderr, "Pasting I%d at I%d (%d,%d)\n", n-2, n-1, x, y);
+      LOG("Pasting I%d at I%d (%d,%d)\n", n-2, n-1, x, y);
       ImagePaste(img[n-1], x, y, img[n-2]);
     } else if (strcmp(av[k], "blend") == 0) {
       if (++k >= ac) { err = 1; break; }
@@ -185,44 +411,375 @@ int main(int ac, char* av[]) {
       w = ImageWidth(img[n-2]);
       h = ImageHeight(img[n-2]);
       if (!ImageValidRect(img[n-1], x, y, w, h)) { err = 6; break; }
-      fprintf(stderr, "Blending I%d with I%d@(%d,%d) with alpha=%.3f\n", n-2, n-1, x, y, alpha);
+      LOG("Blending I%d with I%d@(%d,%d) with alpha=%.3f\n", n-2, n-1, x, y, alpha);
       ImageBlend(img[n-1], x, y, img[n-2], alpha);
     } else if (strcmp(av[k], "locate") == 0) {
       if (n < 2) { err = 2; break; }
-      fprintf(stderr, "Locating I%d in I%d\n", n-2, n-1);
+      LOG("Locating I%d in I%d\n", n-2, n-1);
       if (ImageLocateSubImage(img[n-1], &x, &y, img[n-2])) {
         printf("# FOUND (%d,%d)\n", x, y);
       } else {
         printf("# NOTFOUND\n");
       }
+    } else if (strcmp(av[k], "locateany") == 0) {
+      if (n < 2) { err = 2; break; }
+      LOG("Locating I%d in I%d in any orientation\n", n-2, n-1);
+      int orient;
+      int found = ImageLocateOriented(img[n-1], &x, &y, &orient, img[n-2]);
+      if (found < 0) { err = 4; break; }
+      if (found) {
+        printf("# FOUND (%d,%d) R%d%s\n", x, y, orient % 4, orient >= 4 ? "M" : "");
+      } else {
+        printf("# NOTFOUND\n");
+      }
+    } else if (strcmp(av[k], "locateall") == 0) {
+      if (++k >= ac) { err = 1; break; }
+      if (n < 2) { err = 2; break; }
+      char metric[4];
+      double threshold;
+      int max = -1;
+      if (sscanf(av[k], "%3[a-z],%lf,%d", metric, &threshold, &max) < 2) { err = 5; break; }
+      ImageScore score;
+      if (strcmp(metric, "sad") == 0) score = IMAGE_SAD;
+      else if (strcmp(metric, "ssd") == 0) score = IMAGE_SSD;
+      else if (strcmp(metric, "ncc") == 0) score = IMAGE_NCC;
+      else { err = 5; break; }
+      w = ImageWidth(img[n-1]) - ImageWidth(img[n-2]) + 1;
+      h = ImageHeight(img[n-1]) - ImageHeight(img[n-2]) + 1;
+      if (max < 0) max = w > 0 && h > 0 ? w * h : 0;   // all matches
+      LOG("Locating all matches of I%d in I%d (%s <> %g)\n", n-2, n-1, metric, threshold);
+      // The buffer starts small, instead of holding one match for each
+      // position of a large image up front, and ImageLocateAll returns the
+      // total number of matches, so it is only searched again, with a buffer
+      // large enough, if the first one overflows
+      int capacity = max < LOCATE_MATCHES ? max : LOCATE_MATCHES;
+      ImageMatch* matches = NULL;
+      int found;
+      for (;;) {
+        ImageMatch* grown = realloc(matches, (capacity > 0 ? capacity : 1) * sizeof(ImageMatch));
+        if (grown == NULL) { found = -1; break; }
+        matches = grown;
+        found = ImageLocateAll(img[n-1], img[n-2], score, threshold, matches, capacity);
+        if (found <= capacity || capacity == max) break;
+        capacity = found < max ? found : max;
+      }
+      if (found < 0) { free(matches); err = 4; break; }
+      if (found > capacity) found = capacity;   // only the best max
+      for (int i = 0; i < found; i++) {
+        printf("# MATCH (%d,%d) %.15g\n", matches[i].x, matches[i].y, matches[i].score);
+      }
+      if (found == 0) printf("# NOTFOUND\n");
+      free(matches);
+    } else if (strcmp(av[k], "locatemany") == 0) {
+      if (++k >= ac) { err = 1; break; }
+      int count;
+      if (sscanf(av[k], "%d", &count) != 1 || count < 1) { err = 5; break; }
+      if (n < count + 1) { err = 2; break; }
+      int empty = 0;
+      for (int i = n-1-count; i < n-1; i++) empty |= ImageWidth(img[i]) * ImageHeight(img[i]) == 0;
+      if (empty) { err = 5; break; }   // precondition check!
+      LOG("Locating I%d..I%d in I%d\n", n-1-count, n-2, n-1);
+      // ImageLocateMany returns the total number of matches, so it is only
+      // searched again, with a buffer large enough, if the first one overflows
+      int capacity = LOCATE_MATCHES;
+      ImageMatch* matches = NULL;
+      int found;
+      for (;;) {
+        ImageMatch* grown = realloc(matches, capacity * sizeof(ImageMatch));
+        if (grown == NULL) { found = -1; break; }
+        matches = grown;
+        found = ImageLocateMany(img[n-1], img + n-1-count, count, matches, capacity);
+        if (found <= capacity) break;
+        capacity = found;
+      }
+      if (found < 0) { free(matches); err = 4; break; }
+      for (int i = 0; i < found; i++) {
+        printf("# FOUND I%d (%d,%d)\n", n-1-count + matches[i].index, matches[i].x, matches[i].y);
+      }
+      if (found == 0) printf("# NOTFOUND\n");
+      free(matches);
     } else if (strcmp(av[k], "blur") == 0) {
       if (++k >= ac) { err = 1; break; }
       if (n < 1) { err = 2; break; }
       int dx; int dy;
       if (sscanf(av[k], "%d,%d", &dx, &dy) != 2) { err = 5; break; }
-      fprintf(stderr, "Blur I%d with %dx%d mean filter\n", n-1, 2*dx+1, 2*dy+1);
+      LOG("Blur I%d with %dx%d mean filter\n", n-1, 2*dx+1, 2*dy+1);
       ImageBlur(img[n-1], dx, dy);
+    } else if (strcmp(av[k], "iblur") == 0) {
+      if (++k >= ac) { err = 1; break; }
+      if (n < 1) { err = 2; break; }
+      int dx; int dy;
+      if (sscanf(av[k], "%d,%d", &dx, &dy) != 2) { err = 5; break; }
+      LOG("Blur I%d in place with %dx%d mean filter\n", n-1, 2*dx+1, 2*dy+1);
+      if (!ImageBlurInPlace(img[n-1], dx, dy)) { err = 4; break; }
+    } else if (strcmp(av[k], "gauss") == 0) {
+      if (++k >= ac) { err = 1; break; }
+      if (n < 1) { err = 2; break; }
+      double sigma;
+      if (sscanf(av[k], "%lf", &sigma) != 1) { err = 5; break; }
+      if (!(sigma >= 0.0 && sigma <= 10000.0)) { err = 5; break; }   // precondition check!
+      LOG("Blur I%d with Gaussian filter of sigma %lf\n", n-1, sigma);
+      if (!ImageGaussianBlur(img[n-1], sigma)) { err = 4; break; }
+    } else if (strcmp(av[k], "conv") == 0) {
+      if (++k >= ac) { err = 1; break; }
+      if (n < 1) { err = 2; break; }
+      int kx[CONV_TAPS]; int ky[CONV_TAPS];
+      const char* str = av[k];
+      const int nx = parseKernel(str, kx, CONV_TAPS, &str);
+      if (nx == 0 || *str++ != '/') { err = 5; break; }
+      const int ny = parseKernel(str, ky, CONV_TAPS, &str);
+      if (ny == 0 || *str++ != '/') { err = 5; break; }
+      int divisor; int offset = 0;
+      if (sscanf(str, "%d,%d", &divisor, &offset) < 1) { err = 5; break; }
+      // precondition check!
+      long long weight_x = 0, weight_y = 0;
+      for (int i = 0; i < nx; i++) weight_x += kx[i] < 0 ? -kx[i] : kx[i];
+      for (int i = 0; i < ny; i++) weight_y += ky[i] < 0 ? -ky[i] : ky[i];
+      if (nx % 2 == 0 || ny % 2 == 0 || divisor <= 0 ||
+          255 * weight_x * weight_y > 2147483647LL) { err = 5; break; }
+      LOG("Convolve I%d with %dx%d kernel\n", n-1, nx, ny);
+      if (!ImageConvolve(img[n-1], kx, nx, ky, ny, divisor, offset)) { err = 4; break; }
+    } else if (strcmp(av[k], "median") == 0) {
+      if (++k >= ac) { err = 1; break; }
+      if (n < 1) { err = 2; break; }
+      int dx; int dy;
+      if (sscanf(av[k], "%d,%d", &dx, &dy) != 2) { err = 5; break; }
+      if (dx < 0 || dx > 32767 || dy < 0 || dy > 32767) { err = 5; break; }   // precondition check!
+      LOG("Filter I%d with %dx%d median filter\n", n-1, 2*dx+1, 2*dy+1);
+      if (!ImageMedian(img[n-1], dx, dy)) { err = 4; break; }
+    } else if (strcmp(av[k], "mapblur") == 0) {
+      if (n < 2) { err = 2; break; }
+      if (ImageWidth(img[n-2]) != ImageWidth(img[n-1]) ||
+          ImageHeight(img[n-2]) != ImageHeight(img[n-1])) { err = 5; break; }   // precondition check!
+      LOG("Blur I%d with radius map I%d\n", n-1, n-2);
+      if (!ImageBlurRadiusMap(img[n-1], img[n-2])) { err = 4; break; }
+    } else if (strcmp(av[k], "rect") == 0) {
+      if (++k >= ac) { err = 1; break; }
+      if (n < 1) { err = 2; break; }
+      if (sscanf(av[k], "%d,%d,%d,%d", &x, &y, &w, &h) != 4) { err = 5; break; }
+      if (w <= 0 || h <= 0 || ImageWidth(img[n-1]) * ImageHeight(img[n-1]) == 0) { err = 5; break; }   // precondition check!
+      ImageIntegral ii = ImageIntegralCreate(img[n-1], 0);
+      if (ii == NULL) { err = 4; break; }
+      printf("# RECT (%d,%d,%d,%d) SUM %" PRIu64 " MEAN %.6f\n", x, y, w, h,
+             ImageRectSum(ii, x, y, w, h), ImageRectMean(ii, x, y, w, h));
+      ImageIntegralDestroy(&ii);
+    } else if (strcmp(av[k], "map") == 0) {
+      if (++k >= ac) { err = 1; break; }
+      if (n >= N) { err = 3; break; }
+      LOG("Mapping %s -> I%d\n", av[k], n);
+      img[n] = ImageLoadMapped(av[k]);
+      if (img[n] == NULL) { err = 4; break; }
+      n++;
+    } else if (strcmp(av[k], "stream") == 0) {
+      if (k + 3 >= ac) { err = 1; break; }
+      const char* in = av[++k];
+      const char* out = av[++k];
+      const char* op = av[++k];
+      const char* operand = NULL;
+      if (strcmp(op, "neg") != 0) {
+        if (++k >= ac) { err = 1; break; }
+        operand = av[k];
+      }
+      LOG("Streaming %s %s -> %s\n", op, in, out);
+      if ((err = streamOperation(in, out, op, operand)) != 0) break;
     } else if (strcmp(av[k], "save") == 0) {
       if (++k >= ac) { err = 1; break; }
       if (n < 1) { err = 2; break; }
-      fprintf(stderr, "Saving %s <- I%d\n", av[k], n-1);
-      if (ImageSave(img[n-1], av[k]) == 0) { err = 4; break; }
+      const char* out = outputName(name, sizeof(name), av[k], input);
+      LOG("Saving %s <- I%d\n", out, n-1);
+      if (ImageSave(img[n-1], out) == 0) { err = 4; break; }
     } else {  // image file
       if (n >= N) { err = 3; break; }
-      fprintf(stderr, "Loading %s -> I%d\n", av[k], n);
+      LOG("Loading %s -> I%d\n", av[k], n);
       img[n] = ImageLoad(av[k]);
       if (img[n] == NULL) { err = 4; break; }
       n++;
     }
     k++;
   }
-  
-  // Destroy remaining images
-  while (n > 0) {
-    ImageDestroy(&img[--n]);
+  if (ops.count > 0) flushPointOps(&ops, av, img[n-1]);
+
+  *np = n;
+  return err;
+}
+
+// Wall clock time in seconds
+static double wall_time(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (double)now.tv_sec + 1.0e-9 * (double)now.tv_nsec;
+}
+
+// Shared state of a batch run
+struct batch {
+  int ac;             // the pipeline is av[k..ac-1]
+  char** av;
+  int k;
+  char** files;       // the input files
+  size_t num_files;
+  size_t next;        // index of the next file to process
+  size_t failed;      // number of files that failed
+  double bytes;       // number of pixel bytes loaded
+  pthread_mutex_t lock;
+};
+
+// Batch worker thread: takes input files from the batch until there are none
+// left, loading each as I0 and running the pipeline over it.
+static void* batchWorker(void* arg) {
+  struct batch* batch = arg;
+
+  for (;;) {
+    pthread_mutex_lock(&batch->lock);
+    size_t i = batch->next++;
+    pthread_mutex_unlock(&batch->lock);
+    if (i >= batch->num_files) break;
+
+    const char* file = batch->files[i];
+    Image img[N];
+    int n = 0;
+    int err = 0;
+    double bytes = 0.0;
+
+    img[0] = ImageLoad(file);
+    if (img[0] == NULL) {
+      err = 4;
+    } else {
+      n = 1;
+      bytes = (double)ImageWidth(img[0]) * ImageHeight(img[0]);
+      err = runPipeline(batch->ac, batch->av, batch->k, img, &n, file);
+    }
+
+    if (err != 0) {
+      char msg[256];
+      snprintf(msg, sizeof(msg), errors[err], ImageErrMsg());
+      flockfile(stderr);
+      error(0, errno, "%s: %s", file, msg);
+      funlockfile(stderr);
+    }
+
+    while (n > 0) {
+      ImageDestroy(&img[--n]);
+    }
+
+    pthread_mutex_lock(&batch->lock);
+    batch->failed += err != 0;
+    batch->bytes += bytes;
+    pthread_mutex_unlock(&batch->lock);
+  }
+
+  return NULL;
+}
+
+// Run the pipeline in av[k..ac-1] over each input file in parallel.
+// av[k] may be -jTHREADS, followed by the input (a glob pattern or @LIST).
+static int runBatch(int ac, char* av[], int k) {
+  long threads = sysconf(_SC_NPROCESSORS_ONLN);
+  if (k < ac && strncmp(av[k], "-j", 2) == 0) {
+    if (sscanf(av[k] + 2, "%ld", &threads) != 1 || threads < 1) return 5;
+    k++;
+  }
+  if (k >= ac) return 1;
+  if (threads < 1) threads = 1;
+
+  // Gather the input files
+  const char* input = av[k++];
+  glob_t gl = {0};
+  char** files = NULL;
+  size_t num_files = 0;
+  if (input[0] == '@') {
+    FILE* list = fopen(input + 1, "r");
+    if (list == NULL) error(4, errno, "%s", input + 1);
+    char line[4096];
+    size_t capacity = 0;
+    while (fgets(line, sizeof(line), list) != NULL) {
+      line[strcspn(line, "\r\n")] = '\0';
+      if (line[0] == '\0') continue;
+      if (num_files == capacity) {
+        capacity = capacity ? 2 * capacity : 64;
+        files = realloc(files, capacity * sizeof(char*));
+        if (files == NULL) error(4, errno, "%s", input + 1);
+      }
+      if ((files[num_files++] = strdup(line)) == NULL)
+        error(4, errno, "%s", input + 1);
+    }
+    fclose(list);
+  } else if (glob(input, 0, NULL, &gl) == 0) {
+    files = gl.gl_pathv;
+    num_files = gl.gl_pathc;
+  }
+  if (num_files == 0) error(4, 0, "%s: No input files", input);
+
+  struct batch batch = {
+    .ac = ac, .av = av, .k = k,
+    .files = files, .num_files = num_files,
+  };
+  pthread_mutex_init(&batch.lock, NULL);
+  if ((size_t)threads > num_files) threads = (long)num_files;
+
+  fprintf(stderr, "Processing %zu files with %ld threads\n", num_files, threads);
+  verbose = 0;
+  // Files are already processed in parallel, so each one uses a single
+  // thread (unless the pipeline says otherwise).
+  ImageSetThreads(1);
+  // Counters are kept per thread, but the time unit is shared: find it now,
+  // before the workers may need it.
+  for (int i = k; i < ac; i++) {
+    if (strcmp(av[i], "toc") == 0) {
+      InstrGetCTU();
+      break;
+    }
+  }
+  double time = wall_time();
+
+  pthread_t workers[threads];
+  for (long i = 0; i < threads; i++) {
+    if (pthread_create(&workers[i], NULL, batchWorker, &batch) != 0)
+      error(4, errno, "Creating worker thread");
+  }
+  for (long i = 0; i < threads; i++) {
+    pthread_join(workers[i], NULL);
+  }
+
+  time = wall_time() - time;
+  printf("# Batch: %zu images (%zu failed) in %.3f s: %.1f images/s, "
+         "%.1f MB/s\n", num_files, batch.failed, time, num_files / time,
+         batch.bytes / 1.0e6 / time);
+
+  pthread_mutex_destroy(&batch.lock);
+  if (files == gl.gl_pathv) {
+    globfree(&gl);
+  } else {
+    for (size_t i = 0; i < num_files; i++) free(files[i]);
+    free(files);
+  }
+  errno = 0;
+  return batch.failed != 0 ? 8 : 0;
+}
+
+int main(int ac, char* av[]) {
+  program_name = av[0];
+  if (ac <= 1) {
+    error(5, 0, "\n%s", USAGE);
+  }
+
+  ImageInit();
+
+  int err;
+  if (strcmp(av[1], "batch") == 0) {
+    err = runBatch(ac, av, 2);
+  } else {
+    // The image buffer
+    Image img[N];       // the images
+    int n = 0;          // number of images created
+
+    err = runPipeline(ac, av, 1, img, &n, NULL);
+
+    // Destroy remaining images
+    while (n > 0) {
+      ImageDestroy(&img[--n]);
+    }
   }
 
   error(err, errno, errors[err], ImageErrMsg());
   return 0;
 }
-
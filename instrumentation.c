@@ -9,7 +9,7 @@
 /// // Name the counters you're going to use: 
 /// InstrName[0] = "memops";
 /// InstrName[1] = "adds";
-/// InstrCalibrate();  // Call once, to measure CTU
+/// InstrCalibrate();  // Optional, InstrPrint measures the CTU when needed
 /// ...
 /// InstrReset();  // reset to zero
 /// for (...) {
@@ -22,6 +22,7 @@
 #include "instrumentation.h"
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 /// Cpu time in seconds
 double cpu_time(void) ; ///
@@ -68,20 +69,23 @@ double cpu_time(void) {
 
 #endif
 
-/// Array of operation counters:
-unsigned long InstrCount[NUMCOUNTERS];  ///extern
+/// Array of operation counters (one per thread):
+_Thread_local unsigned long InstrCount[NUMCOUNTERS];  ///extern
 
 /// Array of names for the counters:
 char* InstrName[NUMCOUNTERS] = {NULL};  ///extern
     // All elements initialized to NULL
     // See: https://en.cppreference.com/w/c/language/array_initialization
 
-/// Cpu_time read on previous reset (~seconds)
-double InstrTime;  ///extern
+/// Cpu_time read on previous reset (~seconds, one per thread)
+_Thread_local double InstrTime;  ///extern
 
 /// Calibrated Time Unit (in seconds, initially 1s)
 double InstrCTU = 1.0;  ///extern
 
+// Whether InstrCTU was already found
+static int calibrated = 0;
+
 /// Find the Calibrated Time Unit (CTU).
 /// Run and time a loop of basic memory and arithmetic operations to set
 /// a reasonably cpu-independent time unit.
@@ -99,6 +103,126 @@ void InstrCalibrate(void) { ///
     //printf("%d %d %d\n", i, j, k);  // debug
   }
   InstrCTU = cpu_time() - time;
+  calibrated = 1;
+}
+
+#if defined(__linux__) || defined(__APPLE__)
+
+//
+// GNU/Linux and MacOS code to locate the CTU cache file, and to find the CTU
+// only once when several threads need it
+//
+
+#include <errno.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define INSTR_THREADS
+
+// Store the name of the CTU cache file for this machine in path.
+// Returns 0 if there is no suitable place for it.
+static int cache_path(char *path, size_t size) {
+  char host[256];
+  if (gethostname(host, sizeof(host)) != 0)
+    return 0;
+  host[sizeof(host) - 1] = '\0';
+
+  const char *dir = getenv("XDG_CACHE_HOME");
+  const char *home = getenv("HOME");
+  int len;
+  if (dir != NULL && dir[0] != '\0')
+    len = snprintf(path, size, "%s/instrumentation-ctu-%s", dir, host);
+  else if (home != NULL && home[0] != '\0')
+    len = snprintf(path, size, "%s/.cache/instrumentation-ctu-%s", home, host);
+  else
+    return 0;
+  return len > 0 && (size_t)len < size;
+}
+
+// Create the directory of the cache file in path, if it does not exist (as
+// in a new home directory), so that the cache file can be written.
+// Returns 0 if it does not exist and cannot be created.
+static int cache_dir(const char *path) {
+  char dir[4096];
+  const char *slash = strrchr(path, '/');
+  if (slash == NULL || (size_t)(slash - path) >= sizeof(dir))
+    return 0;
+  memcpy(dir, path, slash - path);
+  dir[slash - path] = '\0';
+  return mkdir(dir, 0700) == 0 || errno == EEXIST;
+}
+
+#else
+
+static int cache_path(char *path, size_t size) {
+  (void)path;
+  (void)size;
+  return 0;
+}
+
+static int cache_dir(const char *path) {
+  (void)path;
+  return 0;
+}
+
+#endif
+
+// Find the CTU, as described in InstrGetCTU, unless it was already found.
+static void findCTU(void) {
+  if (calibrated)
+    return;
+  calibrated = 1;
+
+  double ctu;
+  const char *env = getenv("INSTR_CTU");
+  if (env != NULL && sscanf(env, "%lf", &ctu) == 1) {
+    if (ctu > 0.0)
+      InstrCTU = ctu;
+    return;
+  }
+
+  char path[4096];
+  int has_cache = cache_path(path, sizeof(path));
+  if (has_cache) {
+    FILE *f = fopen(path, "r");
+    if (f != NULL) {
+      int found = fscanf(f, "%lf", &ctu) == 1 && ctu > 0.0;
+      fclose(f);
+      if (found) {
+        InstrCTU = ctu;
+        return;
+      }
+    }
+  }
+
+  InstrCalibrate();
+
+  if (has_cache && cache_dir(path)) {
+    FILE *f = fopen(path, "w");
+    if (f != NULL) {
+      fprintf(f, "%.17g\n", InstrCTU);
+      fclose(f);
+    }
+  }
+}
+
+/// Get the Calibrated Time Unit (CTU), finding it on first use.
+/// The CTU is taken from the first of these that is available:
+///   - the INSTR_CTU environment variable, in seconds
+///     (INSTR_CTU=0 skips calibration, and times are left uncalibrated);
+///   - the per-machine cache file written by a previous run;
+///   - InstrCalibrate(), whose result is then written to the cache file
+///     (creating its directory if needed).
+double InstrGetCTU(void) { ///
+#ifdef INSTR_THREADS
+  // Threads that need the CTU at the same time wait for the first to find it
+  static pthread_once_t once = PTHREAD_ONCE_INIT;
+  pthread_once(&once, findCTU);
+#else
+  findCTU();
+#endif
+  return InstrCTU;
 }
 
 /// Reset counters to zero and store cpu_time.
@@ -113,7 +237,7 @@ void InstrPrint(void) { ///
   // elapsed time since last reset:
   double time = cpu_time() - InstrTime;
   // compute time in calibrated time units:
-  double caltime = time / InstrCTU;
+  double caltime = time / InstrGetCTU();
 
   printf("#%14.15s\t%15.15s", "time", "caltime");
   for (int i = 0; i < NUMCOUNTERS; i++)
@@ -9,7 +9,7 @@
 /// // Name the counters you're going to use: 
 /// InstrName[0] = "memops";
 /// InstrName[1] = "adds";
-/// InstrCalibrate();  // Call once, to measure CTU
+/// InstrCalibrate();  // Optional, InstrPrint measures the CTU when needed
 /// ...
 /// InstrReset();  // reset to zero
 /// for (...) {
@@ -28,14 +28,14 @@ double cpu_time(void) ; ///
 /// Ten counters should be more than enough
 #define NUMCOUNTERS 10
 
-/// Array of operation counters:
-extern unsigned long InstrCount[NUMCOUNTERS];  ///extern
+/// Array of operation counters (one per thread):
+extern _Thread_local unsigned long InstrCount[NUMCOUNTERS];  ///extern
 
 /// Array of names for the counters:
 extern char* InstrName[NUMCOUNTERS];  ///extern
 
-/// Cpu_time read on previous reset (~seconds)
-extern double InstrTime;  ///extern
+/// Cpu_time read on previous reset (~seconds, one per thread)
+extern _Thread_local double InstrTime;  ///extern
 
 /// Calibrated Time Unit (in seconds, initially 1s)
 extern double InstrCTU;  ///extern
@@ -45,6 +45,15 @@ extern double InstrCTU;  ///extern
 /// a reasonably cpu-independent time unit.
 void InstrCalibrate(void) ;
 
+/// Get the Calibrated Time Unit (CTU), finding it on first use.
+/// The CTU is taken from the first of these that is available:
+///   - the INSTR_CTU environment variable, in seconds
+///     (INSTR_CTU=0 skips calibration, and times are left uncalibrated);
+///   - the per-machine cache file written by a previous run;
+///   - InstrCalibrate(), whose result is then written to the cache file
+///     (creating its directory if needed).
+double InstrGetCTU(void) ;
+
 /// Reset counters to zero and store cpu_time.
 void InstrReset(void) ;
 